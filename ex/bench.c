@@ -0,0 +1,421 @@
+#include "libdaemond.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+/*
+ * Measures supervisor hot paths, one JSON object per line on stdout.
+ * Every case runs its own instance, forked from here, whose workers
+ * report CLOCK_MONOTONIC stamps through a pipe
+ */
+
+#define BENCH_LINE    100  // bytes of a captured line
+#define BENCH_MARK    '\1' // ends output of a capture worker
+#define BENCH_TIMEOUT 10   // seconds to wait for any event
+
+enum { EV_READY, EV_CRASH, EV_SIGNAL };
+
+typedef struct {
+	double            at;
+	pid_t             pid;
+	int               what;
+} bench_event;
+
+static int    _G_ev[2];
+static int    _G_iterations = 200;
+static int    _G_workers = 4;
+static double _G_idle = 2;
+static long   _G_lines = 100000;
+static char   _G_name[64];
+static char   _G_log[128];
+static daemond _G_d; // bench's own, for CLI and control calls
+
+static void usage(const char * me) {
+	fprintf(stderr,
+		"Usage: %s [-n iterations] [-w workers] [-t seconds] [-l lines] [case...]\n"
+		"  case - spawn, respawn, stop, signal, idle, capture, capture_raw; default all\n"
+		"  -n - samples of latency cases, default 200\n"
+		"  -w - workers of idle and capture cases, default 4\n"
+		"  -t - idle case duration, seconds, default 2\n"
+		"  -l - lines written by every capture worker, default 100000\n", me);
+}
+
+static void bench_die(const char * what) {
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(255);
+}
+
+static void event_send(int what) {
+	bench_event ev = { daemond_time(), getpid(), what };
+	if (write(_G_ev[1], &ev, sizeof(ev)) != sizeof(ev))
+		_exit(255);
+}
+
+static void event_recv(bench_event * ev) {
+	struct pollfd pfd = { _G_ev[0], POLLIN, 0 };
+	ssize_t r;
+	if (poll(&pfd, 1, BENCH_TIMEOUT * 1000) != 1)
+		bench_die("no event from workers");
+	if ((r = read(_G_ev[0], ev, sizeof(*ev))) != sizeof(*ev))
+		bench_die("short event read");
+}
+
+static void worker_signal(int sig) {
+	int saved = errno;
+	event_send(EV_SIGNAL);
+	errno = saved;
+}
+
+/*
+ * Instance side
+ */
+
+typedef void (*bench_setup)(daemond * d);
+
+static void worker_idle(void) {
+	event_send(EV_READY);
+	while (1)
+		pause();
+}
+
+static void worker_run(const char * kind) {
+	char line[BENCH_LINE];
+	long i;
+
+	if (strcmp(kind, "respawn") == 0) {
+		event_send(EV_READY);
+		event_send(EV_CRASH);
+		_exit(1);
+	}
+	if (strcmp(kind, "signal") == 0) {
+		signal(SIGUSR1, worker_signal);
+	}
+	else if (strncmp(kind, "capture", 7) == 0) {
+		memset(line, 'x', sizeof(line) - 1);
+		line[sizeof(line) - 1] = '\n';
+		for (i = 0; i < _G_lines; i++)
+			fwrite(line, sizeof(line), 1, stdout);
+		fputc(BENCH_MARK, stdout);
+		fputc('\n', stdout);
+		fflush(stdout);
+	}
+	worker_idle();
+}
+
+// forks the instance, its stdout goes to out if given
+static pid_t instance_start(const char * kind, bench_setup setup, int out) {
+	daemond d;
+	pid_t pid;
+
+	if ((pid = fork()) == -1)
+		bench_die("fork");
+	if (pid > 0)
+		return pid;
+
+	signal(SIGCHLD, SIG_DFL);
+	if (out > -1 && dup2(out, STDOUT_FILENO) == -1)
+		_exit(255);
+	daemond_init(&d);
+	d.name = _G_name;
+	d.use_pid = 0;
+	d.detach = 0;
+	d.children_count = 1;
+	if (setup)
+		setup(&d);
+	daemond_master(&d);
+	worker_run(kind);
+	_exit(0);
+}
+
+// stamps the stopped workers left unread don't belong to the next case
+static void events_drain(void) {
+	struct pollfd pfd = { _G_ev[0], POLLIN, 0 };
+	bench_event ev;
+	while (poll(&pfd, 1, 0) == 1 && read(_G_ev[0], &ev, sizeof(ev)) == sizeof(ev))
+		;
+}
+
+static void instance_stop(pid_t pid) {
+	_G_d.stop_int = 5;
+	daemond_cli_kill(&_G_d.cli, pid);
+	events_drain();
+}
+
+/*
+ * Results
+ */
+
+static int cmp_double(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// latencies in seconds, reported in microseconds
+static void report_latency(const char * name, double * s, int n) {
+	double sum = 0;
+	int i;
+	qsort(s, n, sizeof(*s), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += s[i];
+	printf("{\"bench\":\"%s\",\"unit\":\"us\",\"n\":%d,\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f,\"mean\":%.1f}\n",
+		name, n, s[0] * 1e6, s[n / 2] * 1e6, s[n * 9 / 10] * 1e6, s[n * 99 / 100] * 1e6, s[n - 1] * 1e6, sum / n * 1e6);
+	fflush(stdout);
+}
+
+/*
+ * Cases
+ */
+
+static void setup_spawn(daemond * d) {
+	d->control = 1;
+	d->children_count = 0;
+	d->children_max = 1;
+}
+
+// scale 0 -> 1 over the control socket until the new worker runs
+static void bench_spawn(double * s) {
+	char reply[256];
+	bench_event ev;
+	pid_t pid = instance_start("spawn", setup_spawn, -1);
+	int i;
+	double at;
+
+	for (i = 0; daemond_control_call(&_G_d, "pid", reply, sizeof(reply)) == -1; i++) {
+		if (i > BENCH_TIMEOUT * 1000)
+			bench_die("instance socket");
+		usleep(1000);
+	}
+	for (i = 0; i < _G_iterations; i++) {
+		at = daemond_time();
+		if (daemond_control_call(&_G_d, "scale 1", reply, sizeof(reply)) == -1)
+			bench_die("scale 1");
+		event_recv(&ev);
+		s[i] = ev.at - at;
+		if (daemond_control_call(&_G_d, "scale 0", reply, sizeof(reply)) == -1)
+			bench_die("scale 0");
+		// gone once master reaped it, the slot is free again
+		while (kill(ev.pid, 0) == 0)
+			usleep(100);
+	}
+	instance_stop(pid);
+	report_latency("spawn", s, _G_iterations);
+}
+
+static void setup_respawn(daemond * d) {
+	d->max_die = 0;
+	d->min_restart_interval = d->restart_interval = 0;
+}
+
+// worker's exit(1) to its successor running
+static void bench_respawn(double * s) {
+	bench_event ev;
+	pid_t pid = instance_start("respawn", setup_respawn, -1);
+	double crashed = 0;
+	int i = 0;
+
+	while (i < _G_iterations) {
+		event_recv(&ev);
+		if (ev.what == EV_CRASH)
+			crashed = ev.at;
+		else if (crashed > 0)
+			s[i++] = ev.at - crashed;
+	}
+	instance_stop(pid);
+	report_latency("respawn", s, _G_iterations);
+}
+
+// daemond_cli_kill() of master with a running worker until it is gone
+static void bench_stop(double * s) {
+	bench_event ev;
+	pid_t pid;
+	int i;
+	double at;
+
+	for (i = 0; i < _G_iterations; i++) {
+		pid = instance_start("stop", NULL, -1);
+		event_recv(&ev);
+		at = daemond_time();
+		instance_stop(pid);
+		s[i] = daemond_time() - at;
+	}
+	report_latency("stop", s, _G_iterations);
+}
+
+static void setup_signal(daemond * d) {
+	if (daemond_log_file_open(_G_log, 0, 1, 0) == -1)
+		bench_die("log file");
+}
+
+// SIGUSR1 to master, forwarded to the worker's handler
+static void bench_signal(double * s) {
+	bench_event ev;
+	pid_t pid = instance_start("signal", setup_signal, -1);
+	int i;
+	double at;
+
+	event_recv(&ev);
+	for (i = 0; i < _G_iterations; i++) {
+		at = daemond_time();
+		kill(pid, SIGUSR1);
+		event_recv(&ev);
+		s[i] = ev.at - at;
+	}
+	instance_stop(pid);
+	unlink(_G_log);
+	report_latency("signal", s, _G_iterations);
+}
+
+static long ctxt_switches(pid_t pid) {
+	char path[64], line[256];
+	long n, sum = -1;
+	FILE * f;
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1 || sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1)
+			sum = (sum < 0 ? 0 : sum) + n;
+	}
+	fclose(f);
+	return sum;
+}
+
+static void setup_workers(daemond * d) {
+	d->children_count = _G_workers;
+}
+
+// master's context switches while its workers sleep, linux
+static void bench_idle(void) {
+	bench_event ev;
+	pid_t pid = instance_start("idle", setup_workers, -1);
+	long before, after;
+	int i;
+
+	for (i = 0; i < _G_workers; i++)
+		event_recv(&ev);
+	usleep(200000);
+	before = ctxt_switches(pid);
+	usleep(_G_idle * 1e6);
+	after = ctxt_switches(pid);
+	instance_stop(pid);
+	if (before < 0 || after < 0) {
+		printf("{\"bench\":\"idle\",\"unit\":\"wakeups/s\",\"value\":null}\n");
+		return;
+	}
+	printf("{\"bench\":\"idle\",\"unit\":\"wakeups/s\",\"workers\":%d,\"value\":%.2f}\n", _G_workers, (after - before) / _G_idle);
+	fflush(stdout);
+}
+
+static int _G_capture_prefix;
+
+static void setup_capture(daemond * d) {
+	setup_workers(d);
+	d->std_capture = 1;
+	d->std_prefix = _G_capture_prefix;
+	daemond_set_tracer(daemond_record_tracer);
+}
+
+// worker lines through master's capture until every worker's mark is out
+static void bench_capture(int prefix) {
+	char buf[65536];
+	bench_event ev;
+	int out[2], marks = 0, i;
+	pid_t pid;
+	ssize_t got;
+	size_t bytes = 0;
+	double at = 0, took;
+
+	if (pipe(out) == -1)
+		bench_die("pipe");
+	_G_capture_prefix = prefix;
+	pid = instance_start(prefix ? "capture" : "capture_raw", setup_capture, out[1]);
+	close(out[1]);
+	while (marks < _G_workers) {
+		if ((got = read(out[0], buf, sizeof(buf))) <= 0)
+			bench_die("capture read");
+		if (!at)
+			at = daemond_time();
+		bytes += got;
+		for (i = 0; i < got; i++)
+			marks += buf[i] == BENCH_MARK;
+	}
+	took = daemond_time() - at;
+	for (i = 0; i < _G_workers; i++)
+		event_recv(&ev);
+	instance_stop(pid);
+	close(out[0]);
+	printf("{\"bench\":\"%s\",\"unit\":\"lines/s\",\"workers\":%d,\"lines\":%ld,\"value\":%.0f,\"mb_s\":%.1f}\n",
+		prefix ? "capture" : "capture_raw", _G_workers, _G_lines * _G_workers,
+		_G_lines * _G_workers / took, bytes / took / 1e6);
+	fflush(stdout);
+}
+
+static int wanted(int argc, char * argv[], const char * name) {
+	int i;
+	if (optind >= argc)
+		return 1;
+	for (i = optind; i < argc; i++)
+		if (strcmp(argv[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+int main (int argc, char *argv[]) {
+	struct utsname u;
+	double * s;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:w:t:l:h")) != -1) {
+		switch (ch) {
+			case 'n': _G_iterations = atoi(optarg); break;
+			case 'w': _G_workers = atoi(optarg); break;
+			case 't': _G_idle = atof(optarg); break;
+			case 'l': _G_lines = atol(optarg); break;
+			default:
+				usage(argv[0]);
+				return 255;
+		}
+	}
+	if (_G_iterations < 1 || _G_workers < 1 || _G_idle <= 0 || _G_lines < 1) {
+		usage(argv[0]);
+		return 255;
+	}
+	if (!(s = calloc(_G_iterations, sizeof(*s))))
+		bench_die("calloc");
+
+	snprintf(_G_name, sizeof(_G_name), "bench-%d", (int)getpid());
+	snprintf(_G_log, sizeof(_G_log), "/tmp/daemond-%s.log", _G_name);
+	daemond_init(&_G_d);
+	_G_d.name = _G_name;
+	_G_d.stop_term = _G_d.stop_kill = 1;
+
+	// results own stdout, instances are reaped by the kernel
+	daemond_set_tracer(NULL);
+	daemond_set_tracer_debug(NULL);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(_G_ev) == -1)
+		bench_die("pipe");
+
+	uname(&u);
+	printf("{\"bench\":\"meta\",\"system\":\"%s\",\"release\":\"%s\",\"machine\":\"%s\",\"cpus\":%ld,\"iterations\":%d,\"workers\":%d}\n",
+		u.sysname, u.release, u.machine, sysconf(_SC_NPROCESSORS_ONLN), _G_iterations, _G_workers);
+	fflush(stdout);
+
+	if (wanted(argc, argv, "spawn"))       bench_spawn(s);
+	if (wanted(argc, argv, "respawn"))     bench_respawn(s);
+	if (wanted(argc, argv, "stop"))        bench_stop(s);
+	if (wanted(argc, argv, "signal"))      bench_signal(s);
+	if (wanted(argc, argv, "idle"))        bench_idle();
+	if (wanted(argc, argv, "capture"))     bench_capture(1);
+	if (wanted(argc, argv, "capture_raw")) bench_capture(0);
+
+	free(s);
+	return 0;
+}
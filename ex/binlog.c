@@ -0,0 +1,39 @@
+#include "libdaemond.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Decoder for dumps of daemond_binlog_tracer
+ */
+
+int main (int argc, char *argv[]) {
+	int fd, ch, colors = isatty(STDOUT_FILENO), records;
+
+	while ((ch = getopt(argc, argv, "cCh")) != -1) {
+		switch (ch) {
+			case 'c': colors = 1; break;
+			case 'C': colors = 0; break;
+			default:
+				fprintf(stderr, "Usage: %s [-c|-C] dump\n  -c - keep colors\n  -C - strip colors\n", argv[0]);
+				return 255;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Need dump file\n");
+		return 255;
+	}
+
+	if ((fd = open(argv[optind], O_RDONLY)) == -1) {
+		fprintf(stderr, "Can't open `%s': %s\n", argv[optind], strerror(errno));
+		return 255;
+	}
+	if ((records = daemond_binlog_decode(fd, stdout, colors)) == -1) {
+		fprintf(stderr, "Can't decode `%s': %s\n", argv[optind], strerror(errno));
+		return 255;
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include "libdaemond.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+
+/*
+ * Runs CLI command over many instances at once
+ */
+
+static void usage(const char * me) {
+	fprintf(stderr,
+		"Usage: %s [-j jobs] [-x start] [-t int,term,kill] command target...\n"
+		"  command - check, start, stop or restart\n"
+		"  target  - pidfile, glob of pidfiles or \"@name\" of instance socket\n"
+		"  -j - instances handled at once, default all\n"
+		"  -x - shell command starting an instance, \"{}\" is replaced by target\n"
+		"  -t - stop stage timeouts, seconds, default 1,1,1\n", me);
+}
+
+// start command with every "{}" replaced by target
+static char * start_command(const char * tmpl, const char * target) {
+	size_t len = strlen(tmpl) + 1, tlen = strlen(target);
+	const char * p;
+	char * cmd, * c;
+	for (p = tmpl; (p = strstr(p, "{}")); p += 2)
+		len += tlen;
+	if (!(c = cmd = malloc(len)))
+		return NULL;
+	for (p = tmpl; *p; ) {
+		if (p[0] == '{' && p[1] == '}') {
+			memcpy(c, target, tlen);
+			c += tlen;
+			p += 2;
+		}
+		else {
+			*c++ = *p++;
+		}
+	}
+	*c = 0;
+	return cmd;
+}
+
+int main (int argc, char *argv[]) {
+	daemond d;
+	daemond_fleet_item * items = NULL;
+	const char * start = NULL, * command;
+	glob_t g;
+	int ch, jobs = 0, count = 0, failed, i, j;
+	size_t k;
+
+	daemond_init(&d);
+	d.name = "fleet";
+
+	while ((ch = getopt(argc, argv, "j:x:t:h")) != -1) {
+		switch (ch) {
+			case 'j': jobs = atoi(optarg); break;
+			case 'x': start = optarg; break;
+			case 't':
+				if (sscanf(optarg, "%lf,%lf,%lf", &d.stop_int, &d.stop_term, &d.stop_kill) != 3) {
+					fprintf(stderr, "Bad timeouts `%s'\n", optarg);
+					return 255;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 255;
+		}
+	}
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return 255;
+	}
+	command = argv[optind++];
+
+	for (i = optind; i < argc; i++) {
+		bzero(&g, sizeof(g));
+		// sockets and missing pidfiles are taken as is
+		if (argv[i][0] == '@' || glob(argv[i], 0, NULL, &g) != 0) {
+			g.gl_pathc = 0;
+		}
+		for (k = 0; k < (g.gl_pathc ? g.gl_pathc : 1); k++) {
+			if (!(items = realloc(items, ++count * sizeof(*items)))) {
+				fprintf(stderr, "Out of memory\n");
+				return 255;
+			}
+			bzero(&items[count - 1], sizeof(*items));
+			items[count - 1].target = strdup(g.gl_pathc ? g.gl_pathv[k] : argv[i]);
+			if (start)
+				items[count - 1].start = start_command(start, items[count - 1].target);
+		}
+		if (g.gl_pathc)
+			globfree(&g);
+	}
+
+	if ((failed = daemond_fleet(&d, command, items, count, jobs)) == -1) {
+		fprintf(stderr, "Unknown command `%s'\n", command);
+		return 255;
+	}
+
+	printf("%-40s %-6s %8s %8s  %s\n", "TARGET", "RESULT", "PID", "SECONDS", "MESSAGE");
+	for (j = 0; j < count; j++) {
+		printf("%-40s %-6s %8d %8.3f  %s\n", items[j].target, items[j].result ? "failed" : "ok",
+			(int)items[j].pid, items[j].took, items[j].message);
+	}
+	printf("%d of %d ok\n", count - failed, count);
+	return failed ? 1 : 0;
+}
@@ -1,7 +1,12 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <cstring>
+#include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
 
 extern "C"
 {
@@ -32,13 +37,30 @@ void usage(const char *me)
     << "This is testsuite for \"libdaemond\" library" << endl
     << "Usage: " << me << " [Options] [-- CLI]" << endl
     << "Options are:" << endl
+    << "  -A - asynchronous tracer, lines over the queue are dropped" << endl
+    << "  -B - binary tracer, each process dumps it at exit into \"<file>.<pid>\" (see binlog)" << endl
     << "  -C - child processes count, default " << children_count_default << endl
+    << "  -D - captured output backpressure: \"block\" (default), \"newest\" or \"oldest\" to drop" << endl
+    << "  -E - trace lifecycle events of master through hooks" << endl
+    << "  -F - log file for detached daemon, reopened on SIGUSR1" << endl
+    << "  -G - record tracer, every line leaves by one write(2)" << endl
+    << "  -H - threads of every child process, they run the \"-W\" worker" << endl
+    << "  -J - syslog sink: \"journal[:socket]\" or \"rfc5424[:socket]\"" << endl
+    << "  -K - serve control commands on the instance socket, see \"CLI\" below" << endl
     << "  -L - child life time, seconds, default " << child_life_time_default << endl
+    << "  -M - child processes count limit for \"scale\", default \"-C\" value" << endl
     << "  -N - no detach" << endl
+    << "  -O - capture children stdout/stderr, each line prefixed with slot, pid and stream" << endl
+    << "  -Q - serve Prometheus metrics: \"[host:]port\", \"/path\" or \"@name\" of a unix socket" << endl
+    << "  -R - flight recorder depth per child, dumped when a child dies abnormally" << endl
+    << "  -S - instance lock by abstract unix socket instead of PID file" << endl
     << "  -T - reset tracers with b/w standard stream (controlled by \"-o\" option)" << endl
+    << "  -U - pin child processes to NUMA nodes round robin" << endl
+    << "  -W - workers are threads of master, \"-r\" non-zero makes them restart" << endl
     << "  -i - input, default stdin, persistent file recommended in detach mode" << endl
+    << "  -l - log level threshold, 0 (debug) .. 4 (errors only), default 0" << endl
     << "  -m - mode (test name), default " << mode_default << ":" << endl
-    << "    1 - test_standard([-CILNPTiorx])" << endl
+    << "    1 - test_standard([-ABCDEFGHIJKLMNOPQRSTUWilorx])" << endl
     << "    L - test_daemond_pid_lock([-P])" << endl
     << "    W - test_daemond_pid_write([-P])" << endl
     << "    R - test_daemond_pid_relock([-P])" << endl
@@ -53,6 +75,7 @@ void usage(const char *me)
     << "  -h - print this help and exit" << endl
     << "CLI - command line interface for \"libdaemond\" functions, currently:" << endl
     << "  \"start\", \"stop\", \"restart\" or \"check\"," << endl
+    << "  with \"-K\" or \"-S\" also \"status\", \"scale N\", \"reload\", \"drain\" and \"echo ...\"," << endl
     << "  use only after \"--\" pseudo option in mode \"" << mode_default << "\"" << endl
   ;
 }
@@ -61,6 +84,90 @@ string _G_pidfile = pidfile_default;
 IOWrapper _G_io;
 int _G_children_count = children_count_default;
 bool _G_detach = true;
+bool _G_std_capture = false;
+int _G_flight_records = 0;
+int _G_std_policy = DAEMOND_STD_BLOCK;
+bool _G_use_socket = false;
+bool _G_control = false;
+int _G_children_max = 0;
+bool _G_threads = false;
+int _G_threads_per_child = 0;
+bool _G_numa_pin = false;
+bool _G_hooks = false;
+
+// sample of an application command served by master
+int echo_command(daemond *d, const char *args, char *reply, size_t size)
+{
+  snprintf(reply, size, "%s\n", args);
+  return 0;
+}
+struct thread_params
+{
+  int life_time;
+  int ret_val;
+};
+
+// thread worker of "-W": lives its life time or until asked to stop
+int thread_worker(daemond *d, int slot, void *arg)
+{
+  const thread_params *params = static_cast<const thread_params *>(arg);
+  struct pollfd pfd = { daemond_stop_fd(d), POLLIN, 0 };
+  timespec _tm;
+  clock_gettime(CLOCK_MONOTONIC, &_tm);
+  const time_t exit_moment = _tm.tv_sec + params->life_time;
+  int iteration = 0;
+  while (!daemond_stopping(d))
+  {
+    daemond_say(d, "thread %d iteration %d", slot, ++iteration);
+    poll(&pfd, 1, 1000);
+    clock_gettime(CLOCK_MONOTONIC, &_tm);
+    if (_tm.tv_sec >= exit_moment)
+    {
+      daemond_say(d, "thread %d finished with code %d", slot, params->ret_val);
+      return params->ret_val;
+    }
+  }
+  daemond_say(d, "thread %d stopped", slot);
+  return 0;
+}
+// sample of lifecycle hooks: "-E" traces every event
+void lifecycle_hook(daemond *d, const daemond_event *ev, void *)
+{
+  static const char *names[DAEMOND_HOOKS] =
+    { "pre-fork", "child", "forked", "reaped", "respawn", "signal", "shutdown" };
+  switch (ev->event)
+  {
+    case DAEMOND_HOOK_REAPED:
+      daemond_say(d, "<b>hook</> %s slot %d pid %d exit %d signal %d core %d died %d", names[ev->event]
+        , ev->slot, ev->pid, ev->exitcode, ev->termsig, ev->core, ev->died);
+      break;
+    case DAEMOND_HOOK_RESPAWN:
+      daemond_say(d, "<b>hook</> %s after %.3fs", names[ev->event], ev->after);
+      break;
+    case DAEMOND_HOOK_SIGNAL:
+      daemond_say(d, "<b>hook</> %s %d", names[ev->event], ev->signo);
+      break;
+    default:
+      daemond_say(d, "<b>hook</> %s slot %d pid %d", names[ev->event], ev->slot, ev->pid);
+      break;
+  }
+}
+string _G_binlog;
+string _G_log_file;
+string _G_metrics;
+string _G_syslog;
+
+void binlog_dump()
+{
+  ostringstream ostr;
+  ostr << _G_binlog << '.' << getpid();
+  const int fd = open(ostr.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd != -1)
+  {
+    daemond_binlog_dump(fd);
+    close(fd);
+  }
+}
 
 void bw_console_tracer(const char * fmt, va_list va_args)
 {
@@ -196,9 +303,50 @@ int test_standard
   d.name = "sample";
   d.detach = _G_detach;
   d.children_count = _G_children_count;
+  d.std_capture = _G_std_capture;
+  d.flight_records = _G_flight_records;
+  d.std_policy = _G_std_policy;
+  d.use_socket = _G_use_socket;
+  d.control = _G_control;
+  d.children_max = _G_children_max;
+  thread_params params = { life_time, ret_val };
+  if (_G_threads || _G_threads_per_child)
+  {
+    d.worker = thread_worker;
+    d.worker_arg = &params;
+  }
+  d.threads_per_child = _G_threads_per_child;
+  d.numa_pin = _G_numa_pin;
+  daemond_control_register("echo", echo_command);
+  for (int event = 0; _G_hooks && event < DAEMOND_HOOKS; event++)
+  {
+    daemond_hook_add(static_cast<daemond_hook_event>(event), lifecycle_hook, NULL);
+  }
+  d.log_file = _G_log_file.empty() ? NULL : _G_log_file.c_str();
+  d.metrics_listen = _G_metrics.empty() ? NULL : _G_metrics.c_str();
   d.pid.verbose = 1;
   d.use_pid = !_G_pidfile.empty();
   d.pid.pidfile = _G_pidfile.empty() ? NULL : _G_pidfile.c_str();
+  const string status_file = _G_pidfile + ".status";
+  d.status_file = _G_pidfile.empty() ? NULL : status_file.c_str();
+
+  if (!_G_syslog.empty())
+  {
+    const size_t colon = _G_syslog.find(':');
+    const string format = _G_syslog.substr(0, colon);
+    const string path = colon == string::npos ? "" : _G_syslog.substr(colon + 1);
+    if (format != "journal" && format != "rfc5424")
+    {
+      throw runtime_error("Invalid syslog format \"" + format + "\"");
+    }
+    if (daemond_syslog_open(&d, path.empty() ? NULL : path.c_str()
+      , format == "journal" ? DAEMOND_SYSLOG_JOURNAL : DAEMOND_SYSLOG_RFC5424, LOG_DAEMON) == -1)
+    {
+      throw runtime_error("Syslog socket connection failed");
+    }
+    daemond_set_tracer(daemond_syslog_tracer);
+    daemond_set_tracer_debug(daemond_syslog_tracer_debug);
+  }
 
   if (argc)
   {
@@ -219,12 +367,13 @@ int test_standard
   daemond_master(&d);
 
   bool first = true;
-  int exit_moment;
+  int exit_moment, iteration = 0;
   while (true)
   {
     os
       << getpid() << " child iteration" << endl
     ;
+    daemond_flight("child %d iteration %d\n", getpid(), ++iteration);
     sleep(1);
     timespec _tm;
     clock_gettime(CLOCK_MONOTONIC, &_tm);
@@ -353,26 +502,105 @@ int main(int argc, char *argv[])
 
   try
   {
-    while ((ch = getopt(argc, argv, "C:L:NTi:m:o:p:r:x:h")) != -1)
+    while ((ch = getopt(argc, argv, "AB:C:D:EF:GH:J:KL:M:NOQ:R:STUWi:l:m:o:p:r:x:h")) != -1)
     {
       switch (ch)
       {
+        case 'A':
+          if (daemond_async_start(STDOUT_FILENO, 0, DAEMOND_ASYNC_DROP) == -1)
+          {
+            throw runtime_error("Asynchronous tracer start failed");
+          }
+          daemond_set_tracer(daemond_async_tracer);
+          daemond_set_tracer_debug(daemond_async_tracer);
+          break;
+        case 'B':
+          _G_binlog = optarg;
+          atexit(binlog_dump);
+          daemond_set_tracer(daemond_binlog_tracer);
+          daemond_set_tracer_debug(daemond_binlog_tracer);
+          break;
         case 'C':
           _G_children_count = c_string_to_uint(optarg);
           break;
+        case 'D':
+          {
+            const string _arg(optarg);
+            if (_arg == "block")
+            {
+              _G_std_policy = DAEMOND_STD_BLOCK;
+            }
+            else if (_arg == "newest")
+            {
+              _G_std_policy = DAEMOND_STD_DROP_NEWEST;
+            }
+            else if (_arg == "oldest")
+            {
+              _G_std_policy = DAEMOND_STD_DROP_OLDEST;
+            }
+            else
+            {
+              throw runtime_error("Invalid backpressure policy \"" + _arg + "\"");
+            }
+          }
+          break;
+        case 'E':
+          _G_hooks = true;
+          break;
+        case 'F':
+          _G_log_file = optarg;
+          break;
+        case 'G':
+          daemond_set_tracer(daemond_record_tracer);
+          daemond_set_tracer_debug(daemond_record_tracer);
+          break;
+        case 'H':
+          _G_threads_per_child = c_string_to_uint(optarg);
+          break;
+        case 'J':
+          _G_syslog = optarg;
+          break;
+        case 'K':
+          _G_control = true;
+          break;
+        case 'M':
+          _G_children_max = c_string_to_uint(optarg);
+          break;
         case 'L':
           child_life_time = c_string_to_uint(optarg);
           break;
         case 'N':
           _G_detach = false;
           break;
+        case 'O':
+          _G_std_capture = true;
+          break;
+        case 'Q':
+          _G_metrics = optarg;
+          break;
+        case 'R':
+          _G_flight_records = c_string_to_uint(optarg);
+          break;
+        case 'S':
+          _G_use_socket = true;
+          _G_pidfile.clear();
+          break;
         case 'T':
           daemond_set_tracer(bw_console_tracer);
           daemond_set_tracer_debug(bw_console_tracer);
           break;
+        case 'U':
+          _G_numa_pin = true;
+          break;
+        case 'W':
+          _G_threads = true;
+          break;
         case 'i':
           _G_io.set_input(optarg);
           break;
+        case 'l':
+          daemond_set_log_level(c_string_to_uint(optarg));
+          break;
         case 'm':
           mode = optarg;
           break;
@@ -0,0 +1,303 @@
+#include "libdaemond.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+/*
+ * Crash loop: children_count workers living a few milliseconds each and
+ * dying by a mix of ways, master respawning them without backoff. Prints
+ * master's CPU, memory and respawn rate every second and a summary, one
+ * JSON object per line. Workers report CLOCK_MONOTONIC stamps through a
+ * pipe, the latency is from a worker's death to its successor running
+ */
+
+enum { EV_READY, EV_CRASH };
+enum { WAY_EXIT, WAY_ABORT, WAY_SEGV, WAY_KILL, WAY_CLEAN, WAYS };
+
+static const char * ways[WAYS] = { "exit", "abort", "segv", "kill", "clean" };
+
+typedef struct {
+	double            at;
+	int               slot;
+	int               what;
+} stress_event;
+
+static int    _G_ev[2];
+static int    _G_children = 1000;
+static double _G_life_min = 0.005;
+static double _G_life_max = 0.020;
+static double _G_duration = 10;
+static double _G_interval = 0;
+static int    _G_mix[WAYS] = { 1, 1, 1, 1, 0 };
+static int    _G_mix_sum = 4;
+
+static void usage(const char * me) {
+	fprintf(stderr,
+		"Usage: %s [-C children] [-L min[:max]] [-x way=weight,...] [-i interval] [-t seconds]\n"
+		"  -C - workers, default 1000\n"
+		"  -L - worker life time, milliseconds, random in min..max, default 5:20\n"
+		"  -x - crash mix, ways are exit, abort, segv, kill and clean (exit 0),\n"
+		"       default exit=1,abort=1,segv=1,kill=1\n"
+		"  -i - restart interval, seconds, default 0\n"
+		"  -t - duration, seconds, default 10\n", me);
+}
+
+static void stress_die(const char * what) {
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(255);
+}
+
+static int parse_mix(char * arg) {
+	char * item, * eq;
+	int i;
+	memset(_G_mix, 0, sizeof(_G_mix));
+	_G_mix_sum = 0;
+	for (item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+		if (!(eq = strchr(item, '=')))
+			return -1;
+		*eq++ = 0;
+		for (i = 0; i < WAYS && strcmp(ways[i], item) != 0; i++);
+		if (i == WAYS || atoi(eq) < 0)
+			return -1;
+		_G_mix[i] = atoi(eq);
+		_G_mix_sum += _G_mix[i];
+	}
+	return _G_mix_sum > 0 ? 0 : -1;
+}
+
+/*
+ * Worker
+ */
+
+static void event_send(int slot, int what) {
+	stress_event ev = { daemond_time(), slot, what };
+	if (write(_G_ev[1], &ev, sizeof(ev)) != sizeof(ev))
+		_exit(255);
+}
+
+static void worker_run(int slot) {
+	int way, pick;
+
+	srand(getpid());
+	event_send(slot, EV_READY);
+	usleep((_G_life_min + (_G_life_max - _G_life_min) * rand() / RAND_MAX) * 1e6);
+
+	pick = rand() % _G_mix_sum;
+	for (way = 0; pick >= _G_mix[way]; way++)
+		pick -= _G_mix[way];
+	event_send(slot, EV_CRASH);
+	switch (way) {
+		case WAY_EXIT:  _exit(1);
+		case WAY_ABORT: abort();
+		case WAY_SEGV:  raise(SIGSEGV); break;
+		case WAY_KILL:  raise(SIGKILL); break;
+	}
+	_exit(0);
+}
+
+/*
+ * Master's side, linux /proc
+ */
+
+static double master_cpu(pid_t pid) {
+	char path[64], buf[1024], * p;
+	unsigned long utime, stime;
+	FILE * f;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	buf[fread(buf, 1, sizeof(buf) - 1, f)] = 0;
+	fclose(f);
+	// comm may hold spaces, fields count from its closing paren
+	if (!(p = strrchr(buf, ')')) || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu%n", &utime, &stime, &n) != 2 || !n)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static long master_kb(pid_t pid, const char * field) {
+	char path[64], line[256];
+	size_t len = strlen(field);
+	long kb = -1;
+	FILE * f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			kb = atol(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+/*
+ * Results
+ */
+
+typedef struct {
+	double          * v;
+	size_t            n;
+	size_t            size;
+} samples;
+
+static void samples_add(samples * s, double v) {
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 65536;
+		if (!(s->v = realloc(s->v, s->size * sizeof(double))))
+			stress_die("realloc");
+	}
+	s->v[s->n++] = v;
+}
+
+static int cmp_double(const void * a, const void * b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double samples_at(samples * s, double q) {
+	return s->n ? s->v[(size_t)(s->n * q) < s->n ? (size_t)(s->n * q) : s->n - 1] * 1e6 : 0;
+}
+
+int main (int argc, char *argv[]) {
+	struct rlimit nocore = { 0, 0 };
+	struct pollfd pfd;
+	stress_event ev[256];
+	samples lat = { NULL, 0, 0 };
+	double * crashed, started, now, tick, cpu, cpu_tick, stop_at;
+	unsigned long respawns = 0, respawns_tick = 0, deaths = 0;
+	daemond d, ctl;
+	pid_t pid;
+	ssize_t got;
+	char * colon;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "C:L:x:i:t:h")) != -1) {
+		switch (ch) {
+			case 'C': _G_children = atoi(optarg); break;
+			case 'L':
+				_G_life_min = _G_life_max = atof(optarg) / 1000;
+				if ((colon = strchr(optarg, ':')))
+					_G_life_max = atof(colon + 1) / 1000;
+				break;
+			case 'x':
+				if (parse_mix(optarg) == -1) {
+					usage(argv[0]);
+					return 255;
+				}
+				break;
+			case 'i': _G_interval = atof(optarg); break;
+			case 't': _G_duration = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return 255;
+		}
+	}
+	if (_G_children < 1 || _G_life_min < 0 || _G_life_max < _G_life_min || _G_interval < 0 || _G_duration <= 0) {
+		usage(argv[0]);
+		return 255;
+	}
+	if (!(crashed = calloc(_G_children, sizeof(double))))
+		stress_die("calloc");
+
+	// results own stdout, aborts don't dump thousands of cores
+	daemond_set_tracer(NULL);
+	daemond_set_tracer_debug(NULL);
+	setrlimit(RLIMIT_CORE, &nocore);
+	signal(SIGCHLD, SIG_IGN);
+	if (pipe(_G_ev) == -1)
+		stress_die("pipe");
+#ifdef F_SETPIPE_SZ
+	fcntl(_G_ev[0], F_SETPIPE_SZ, 1 << 20);
+#endif
+
+	daemond_init(&d);
+	d.name = "stress";
+	d.use_pid = 0;
+	d.detach = 0;
+	d.children_count = _G_children;
+	d.max_die = 0;
+	d.min_restart_interval = d.restart_interval = _G_interval;
+
+	started = daemond_time();
+	if ((pid = fork()) == -1)
+		stress_die("fork");
+	if (pid == 0) {
+		signal(SIGCHLD, SIG_DFL);
+		close(_G_ev[0]);
+		daemond_master(&d);
+		worker_run(d.slot);
+	}
+	close(_G_ev[1]);
+
+	printf("{\"stress\":\"config\",\"children\":%d,\"life_ms\":[%.1f,%.1f],\"interval\":%.3f,\"mix\":{", _G_children,
+		_G_life_min * 1e3, _G_life_max * 1e3, _G_interval);
+	for (i = 0; i < WAYS; i++)
+		printf("%s\"%s\":%d", i ? "," : "", ways[i], _G_mix[i]);
+	printf("}}\n");
+	fflush(stdout);
+
+	cpu_tick = 0;
+	tick = started + 1;
+	stop_at = started + _G_duration;
+	pfd.fd = _G_ev[0];
+	pfd.events = POLLIN;
+	while ((now = daemond_time()) < stop_at) {
+		if (poll(&pfd, 1, (tick - now) * 1000 + 1) > 0) {
+			if ((got = read(_G_ev[0], ev, sizeof(ev))) <= 0)
+				stress_die("master gone");
+			for (i = 0; i < got / (ssize_t)sizeof(ev[0]); i++) {
+				if (ev[i].slot < 0 || ev[i].slot >= _G_children)
+					continue;
+				if (ev[i].what == EV_CRASH) {
+					crashed[ev[i].slot] = ev[i].at;
+					deaths++;
+				}
+				else if (crashed[ev[i].slot] > 0) {
+					samples_add(&lat, ev[i].at - crashed[ev[i].slot]);
+					crashed[ev[i].slot] = 0;
+					respawns++;
+				}
+			}
+		}
+		if ((now = daemond_time()) >= tick) {
+			cpu = master_cpu(pid);
+			printf("{\"stress\":\"tick\",\"t\":%.1f,\"respawns_s\":%.0f,\"master_cpu\":%.3f,\"rss_kb\":%ld}\n",
+				now - started, (respawns - respawns_tick) / (now - tick + 1), (cpu - cpu_tick) / (now - tick + 1),
+				master_kb(pid, "VmRSS"));
+			fflush(stdout);
+			cpu_tick = cpu;
+			respawns_tick = respawns;
+			tick += 1;
+		}
+	}
+	cpu = master_cpu(pid);
+
+	qsort(lat.v, lat.n, sizeof(double), cmp_double);
+	printf("{\"stress\":\"total\",\"seconds\":%.1f,\"deaths\":%lu,\"respawns\":%lu,\"respawns_s\":%.0f,"
+		"\"master_cpu_s\":%.3f,\"master_cpu\":%.3f,\"rss_kb\":%ld,\"hwm_kb\":%ld,"
+		"\"respawn_us\":{\"p50\":%.0f,\"p90\":%.0f,\"p99\":%.0f,\"max\":%.0f}",
+		now - started, deaths, respawns, respawns / (now - started),
+		cpu, cpu / (now - started), master_kb(pid, "VmRSS"), master_kb(pid, "VmHWM"),
+		samples_at(&lat, 0.5), samples_at(&lat, 0.9), samples_at(&lat, 0.99), samples_at(&lat, 1));
+
+	daemond_init(&ctl);
+	ctl.name = "stress";
+	ctl.stop_int = 10;
+	now = daemond_time();
+	daemond_cli_kill(&ctl.cli, pid);
+	printf(",\"stop_s\":%.3f}\n", daemond_time() - now);
+
+	free(lat.v);
+	free(crashed);
+	return 0;
+}
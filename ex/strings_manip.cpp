@@ -1,6 +1,94 @@
 #include "strings_manip.h"
 #include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifndef __linux__
 #include <vis.h>
+#else
+// linux libc lacks these BSD ones, just enough of them for the helpers below
+
+#define VIS_CSTYLE 0x02
+#define VIS_WHITE  0x0c
+
+static long long strtonum(const char *src, long long minval, long long maxval, const char **errstr)
+{
+  char *end;
+  long long res;
+
+  errno = 0;
+  *errstr = NULL;
+  if (minval > maxval)
+  {
+    errno = EINVAL;
+    *errstr = "invalid";
+    return 0;
+  }
+  res = strtoll(src, &end, 10);
+  if (end == src || *end)
+  {
+    errno = EINVAL;
+    *errstr = "invalid";
+    return 0;
+  }
+  if ((res == LLONG_MIN && errno == ERANGE) || res < minval)
+  {
+    errno = ERANGE;
+    *errstr = "too small";
+    return 0;
+  }
+  if ((res == LLONG_MAX && errno == ERANGE) || res > maxval)
+  {
+    errno = ERANGE;
+    *errstr = "too large";
+    return 0;
+  }
+  return res;
+}
+
+// C style escapes, white space encoded too; flags are always VIS_CSTYLE | VIS_WHITE here
+static int strvisx(char *dst, const char *src, size_t length, int)
+{
+  char *start = dst;
+  char esc;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    const unsigned char c = src[i];
+    switch (c)
+    {
+      case '\a': esc = 'a'; break;
+      case '\b': esc = 'b'; break;
+      case '\t': esc = 't'; break;
+      case '\n': esc = 'n'; break;
+      case '\v': esc = 'v'; break;
+      case '\f': esc = 'f'; break;
+      case '\r': esc = 'r'; break;
+      case ' ':  esc = 's'; break;
+      case '\\': esc = '\\'; break;
+      default:   esc = 0;
+    }
+    if (esc)
+    {
+      *dst++ = '\\';
+      *dst++ = esc;
+    }
+    else if (isgraph(c))
+    {
+      *dst++ = c;
+    }
+    else
+    {
+      dst += sprintf(dst, "\\%03o", c);
+    }
+  }
+  *dst = 0;
+  return dst - start;
+}
+#endif
 
 int8_t c_string_to_int8(const char *src)
 {
@@ -1,8 +1,8 @@
 #!/bin/sh
 
-# Writing a fully self-contained test is too complicated task (at least I think so),
-# therefore satisfy with a small manual test or use executable file with
-# a variety of options directly to ensure efficiency of library
+# Small manual tests of the sample executable with a variety of options;
+# mode T runs the lifecycle ones unattended, with timing limits, so a slower
+# respawn or shutdown fails it
 
 set -e
 
@@ -10,6 +10,11 @@ readonly EXECUTABLE_DEFAULT="sample"
 readonly MODE_DEFAULT="N"
 readonly PID_FILE="./sample.pid"
 
+# limits of mode T, seconds
+readonly RESPAWN_MAX=0.6   # slot waits for restart at most, restart interval is 0.1
+readonly BACKOFF_MIN=0.3   # wait once children died max_die times in a row
+readonly STOP_MAX=1        # "stop" of a master with 4 workers
+
 EXECUTABLE=$EXECUTABLE_DEFAULT
 MODE=$MODE_DEFAULT
 EXIT=0
@@ -21,7 +26,7 @@ usage () {
   echo "Usage: `basename $0` [options]"
   echo "Options are:"
   echo "  -E - path to sample executable, default \"$EXECUTABLE_DEFAULT\""
-  echo "       usually it places in CMAKE_BINARY_DIR (see cmake(1))"
+  echo "       usually it places in CMAKE_BINARY_DIR (see cmake(1)), \"sample_d\" in Debug builds"
   echo "  -m - mode, one of the following, default \"$MODE_DEFAULT\""
   echo "    $MODE_DEFAULT - run daemon in detach mode with single child"
   echo "    A - 2 children call abort(3) every 3 seconds, no detach"
@@ -32,6 +37,9 @@ usage () {
   echo "    L - two processes try lock same PID file ($PID_FILE)"
   echo "    W - two processes try rewrite same PID file ($PID_FILE)"
   echo "    R - two processes try relock same PID file ($PID_FILE)"
+  echo "    T - automated lifecycle checks in temp dirs: respawn after every"
+  echo "        child exit way, backoff, PID file lock races and shutdown time,"
+  echo "        exits non-zero if any fails"
   echo "  -v - show diagnostic messages"
   echo "  -vv - show diagnostic messages and set -x"
   echo "  -h - show help message and exit"
@@ -72,7 +80,7 @@ if [ -z "$MODE" ];
 then
   echo "*** Mode not set" >&2
   EXIT=1
-elif [ "$MODE" != "$MODE_DEFAULT" ] && [ "$MODE" != "A" ] && [ "$MODE" != "X" ] && [ "$MODE" != "E" ] && [ "$MODE" != "S" ] && [ "$MODE" != "C" ] && [ "$MODE" != "L" ] && [ "$MODE" != "W" ] && [ "$MODE" != "R" ];
+elif [ "$MODE" != "$MODE_DEFAULT" ] && [ "$MODE" != "A" ] && [ "$MODE" != "X" ] && [ "$MODE" != "E" ] && [ "$MODE" != "S" ] && [ "$MODE" != "C" ] && [ "$MODE" != "L" ] && [ "$MODE" != "W" ] && [ "$MODE" != "R" ] && [ "$MODE" != "T" ];
 then
   echo "*** Mode \"$MODE\" invalid" >&2
   EXIT=1
@@ -95,8 +103,212 @@ then
 fi
 
 
+#Mode T helpers
+FAILED=0
+
+now () {
+  date +%s.%N
+}
+
+# seconds since $1
+elapsed () {
+  awk -v a="$1" -v b="`now`" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# $1 <= $2 for fractional numbers
+le () {
+  awk -v a="$1" -v b="$2" 'BEGIN { exit !(a <= b) }'
+}
+
+check_result () {
+  if [ $1 -eq 0 ];
+  then
+    echo "ok - $2"
+  else
+    echo "not ok - $2"
+    FAILED=$((FAILED + 1))
+  fi
+}
+
+# runs sample in a new temp dir, its pidfile is $DIR/sample.pid
+instance () {
+  DIR=`mktemp -d "${TMPDIR:-/tmp}/daemond-test.XXXXXX"`
+  (cd "$DIR" && ulimit -c 0 && exec "$EXECUTABLE" -N -p "$DIR/sample.pid" "$@" -- start < /dev/null > "$DIR/out" 2>&1) &
+  INSTANCE=$!
+}
+
+instance_check () {
+  "$EXECUTABLE" -p "$DIR/sample.pid" -- check 2> /dev/null
+}
+
+instance_done () {
+  "$EXECUTABLE" -p "$DIR/sample.pid" -- stop > /dev/null 2>&1 || true
+  wait $INSTANCE 2> /dev/null || true
+  if [ $VERBOSE -ne 0 ];
+  then
+    cat "$DIR/out"
+  fi
+  rm -rf "$DIR"
+}
+
+# waits up to $2 seconds for "check" output matching $1
+instance_wait () {
+  _started=`now`
+  while ! instance_check | grep -q "$1";
+  do
+    le "`elapsed $_started`" "$2" || return 1
+    sleep 0.05
+  done
+}
+
+# watches slot 0 for $1 seconds, GAPS gets every time it waited for restart,
+# FORKS how many times it was forked
+watch_restarts () {
+  GAPS=""
+  FORKS=0
+  _started=`now`
+  _gap=""
+  while le "`elapsed $_started`" "$1";
+  do
+    _line=`instance_check | grep "slot 0 - "`
+    case "$_line" in
+      *restarting*)
+        [ -n "$_gap" ] || _gap=`now`
+      ;;
+      *pid*)
+        [ -z "$_gap" ] || GAPS="$GAPS `elapsed $_gap`"
+        _gap=""
+      ;;
+    esac
+    _forks=`echo "$_line" | sed -n 's/.*forked \([0-9]*\) times.*/\1/p'`
+    [ -z "$_forks" ] || FORKS=$_forks
+    sleep 0.01
+  done
+}
+
+max_of () {
+  echo "$@" | awk '{ m = 0; for (i = 1; i <= NF; i++) if ($i > m) m = $i; print m }'
+}
+
+test_respawn () {
+  instance -C1 -L0 -r1 -x$1
+  watch_restarts 5
+  _max=`max_of $GAPS`
+  [ $FORKS -ge 2 ] && le "$_max" $RESPAWN_MAX
+  check_result $? "respawn after $1: forked $FORKS times, waited$GAPS (max $RESPAWN_MAX)"
+  instance_done
+}
+
+test_backoff () {
+  instance -C1 -L0 -r1 -xexit
+  watch_restarts 9
+  _first=`echo $GAPS | awk '{ print $1 }'`
+  _max=`max_of $GAPS`
+  [ -n "$_first" ] && le "$_first" $RESPAWN_MAX && le $BACKOFF_MIN "$_max"
+  check_result $? "backoff: waited$GAPS (first at most $RESPAWN_MAX, then at least $BACKOFF_MIN)"
+  instance_done
+}
+
+# two processes race for one PID file, exactly one has to hold it
+test_lock_race () {
+  DIR=`mktemp -d "${TMPDIR:-/tmp}/daemond-test.XXXXXX"`
+  "$EXECUTABLE" -p "$DIR/sample.pid" -m$1 > /dev/null 2>&1 &
+  _first=$!
+  "$EXECUTABLE" -p "$DIR/sample.pid" -m$2 > /dev/null 2>&1 &
+  _second=$!
+  sleep 1
+  _holders=0
+  for _pid in $_first $_second;
+  do
+    # a holder stops itself, the loser exits
+    if [ "`ps -o stat= -p $_pid 2> /dev/null | cut -c1`" = "T" ];
+    then
+      _holders=$((_holders + 1))
+    fi
+  done
+  kill -KILL $_first $_second 2> /dev/null || true
+  wait $_first $_second 2> /dev/null || true
+  [ $_holders -eq 1 ]
+  check_result $? "PID file race $1/$2: $_holders holder(s)"
+  rm -rf "$DIR"
+}
+
+test_start_race () {
+  DIR=`mktemp -d "${TMPDIR:-/tmp}/daemond-test.XXXXXX"`
+  for _i in 1 2;
+  do
+    "$EXECUTABLE" -N -C1 -L60 -p "$DIR/sample.pid" -- start < /dev/null > "$DIR/out.$_i" 2>&1 &
+    eval _start$_i=$!
+  done
+  sleep 1
+  _alive=0
+  for _pid in $_start1 $_start2;
+  do
+    if kill -0 $_pid 2> /dev/null && [ "`ps -o stat= -p $_pid | cut -c1`" != "Z" ];
+    then
+      _alive=$((_alive + 1))
+      _owner=$_pid
+    fi
+  done
+  [ $_alive -eq 1 ] && instance_check | grep -q "pid $_owner,"
+  check_result $? "start race: $_alive master(s) running"
+  INSTANCE="$_start1 $_start2"
+  instance_done
+}
+
+# time of "stop" and no worker left behind
+test_shutdown () {
+  instance -C4 -L60 $1
+  if ! instance_wait "4 of 4 workers" 5;
+  then
+    check_result 1 "shutdown${1:+ $1}: workers did not start"
+    instance_done
+    return
+  fi
+  _workers=`instance_check | sed -n 's/.*slot [0-9]* - pid \([0-9]*\),.*/\1/p'`
+  _started=`now`
+  "$EXECUTABLE" -p "$DIR/sample.pid" -- stop > /dev/null 2>&1 || true
+  _took=`elapsed $_started`
+  _left=""
+  for _pid in $INSTANCE $_workers;
+  do
+    if kill -0 $_pid 2> /dev/null && [ "`ps -o stat= -p $_pid | cut -c1`" != "Z" ];
+    then
+      _left="$_left $_pid"
+    fi
+  done
+  [ -z "$_left" ] && le "$_took" $STOP_MAX
+  check_result $? "shutdown${1:+ $1}: ${_took}s (max $STOP_MAX)${_left:+, left$_left}"
+  instance_done
+}
+
 #The actual commands
-if [ "$MODE" = "$MODE_DEFAULT" ];
+if [ "$MODE" = "T" ];
+then
+  case "$EXECUTABLE" in
+    /*) ;;
+    *) EXECUTABLE="`pwd`/$EXECUTABLE" ;;
+  esac
+  set +e
+  for WAY in abort except exit sf;
+  do
+    test_respawn $WAY
+  done
+  test_backoff
+  test_lock_race L L
+  test_lock_race L W
+  test_lock_race L R
+  test_start_race
+  test_shutdown
+  test_shutdown -W
+  if [ $FAILED -ne 0 ];
+  then
+    echo "*** $FAILED check(s) failed" >&2
+    exit 1
+  fi
+  exit 0
+
+elif [ "$MODE" = "$MODE_DEFAULT" ];
 then
   $EXECUTABLE -C1 -L3 -p $PID_FILE -- start
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "libdaemond.h"
 
 #include <stdlib.h>
@@ -19,16 +20,56 @@
 #include <signal.h>
 //#include <sys/signal.h>
 #include <sys/wait.h>
-
-#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 
 #include <syslog.h>
-
-#define debug(f, ...) debug_output("[%d] " f " at %s line %d.\n", getpid(), ##__VA_ARGS__, __FILE__, __LINE__)
-#define warn(f, ...) debug_output(f " at %s line %d.\n", ##__VA_ARGS__, __FILE__, __LINE__)
-#define ewarn(f, ...) debug_output(f ": %s at %s line %d.\n", ##__VA_ARGS__, strerror(errno), __FILE__, __LINE__)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <wchar.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+// arguments are evaluated only if level passes both floor and threshold
+#define trace(level, f, ...) do { if (daemond_log_enabled(level)) debug_output(level, f, ##__VA_ARGS__); } while (0)
+#define debug(f, ...) trace(DAEMOND_LOG_DEBUG, "[%d] " f " at %s line %d.\n", getpid(), ##__VA_ARGS__, __FILE__, __LINE__)
+#define warn(f, ...) trace(DAEMOND_LOG_WARN, f " at %s line %d.\n", ##__VA_ARGS__, __FILE__, __LINE__)
+#define ewarn(f, ...) trace(DAEMOND_LOG_WARN, f ": %s at %s line %d.\n", ##__VA_ARGS__, strerror(errno), __FILE__, __LINE__)
+#define debug_ratelimited(burst, interval, f, ...) do { \
+		static __thread daemond_ratelimit _rl; \
+		if (daemond_log_enabled(DAEMOND_LOG_DEBUG) && daemond_ratelimit_pass(&_rl, burst, interval)) \
+			debug(f, ##__VA_ARGS__); \
+	} while (0)
 #define ERR strerror(errno)
 
+static double htime();
+static void daemond_flight_vrecord(const char * fmt, va_list va_args);
+static void daemond_respawn_backoff(daemond * d, int died);
+static int daemond_slot_stop(daemond * d, int slot);
+static pid_t daemond_slot_pid(daemond * d, int slot);
+static void daemond_record_say(daemond * d, tracer_t tracer, const char * fmt, va_list va_args, const char * tail);
+static void nonblock(int fd);
+
+static const char * signame(int sig) {
+#if defined(__GLIBC__) && ( __GLIBC__ > 2 || __GLIBC_MINOR__ >= 32 )
+	const char * name = sigabbrev_np(sig);
+	return name ? name : "?";
+#elif defined(__linux__)
+	return strsignal(sig);
+#else
+	return sig > 0 && sig < NSIG ? sys_signame[sig] : "?";
+#endif
+}
+
 static void die (const char * f, ...) {
 	va_list va_args;
 	va_start(va_args,f);
@@ -41,89 +82,133 @@ static void die (const char * f, ...) {
 
 // verbosity + colors
 
+/*
+ * Tags are looked up by their first char, which is a perfect hash for the
+ * set below: <r>, <red>, <b>, ... - all match by the first letter
+ */
+static const char * colors[128] = {
+	['/'] = "\033[0m",
+	['b'] = "\033[1m",
+
+	['r'] = "\033[31m",
+	['g'] = "\033[32m",
+	['y'] = "\033[33m",
+	['n'] = "\033[34m",
+	['w'] = "\033[37m",
+};
+
+#define DAEMOND_COLOR_CACHE 512
+
 typedef struct {
-	char *n;
-	char *seq;
-} daemond_term_color_t;
+	const char      * fmt;
+	const char      * src;   // copy of fmt, a reused buffer must not hit
+	const char      * out;
+} daemond_color_entry;
 
+// translated formats keyed by fmt pointer: [0] with colors, [1] stripped
+static daemond_color_entry _G_color_cache[2][DAEMOND_COLOR_CACHE];
 
-static daemond_term_color_t colors[] = {
-	{ "/", "0" },
-	{ "b", "1" },
+static int _G_colors = -1;      // -1 - if stdout is a terminal, 0 - never, 1 - always
+static int _G_colors_tty = -1;  // isatty(stdout), -1 - unknown yet
 
-	{ "r", "31" },
-	{ "g", "32" },
-	{ "y", "33" },
-	{ "n", "34" },
-	{ "w", "37" },
-	{ NULL,NULL }
-};
+void daemond_set_colors(int mode) {
+	_G_colors = mode;
+}
 
+static int daemond_colors_strip(void) {
+	if (_G_colors > -1)
+		return !_G_colors;
+	if (_G_colors_tty == -1)
+		_G_colors_tty = isatty(STDOUT_FILENO);
+	return !_G_colors_tty;
+}
 
-static void vcolorprintf(const char * fmt, va_list va_args) {
-	char buf[4096];
-	bzero(buf,4096);
-	char *p, *b, *end, *be;
-	p = (char *)fmt;
-	b = be = buf;
+// translates <tags> of fmt into terminal sequences, or drops them if strip
+static size_t daemond_colorize(const char * fmt, char * buf, size_t size, int strip) {
+	const char *p = fmt, *end, *seq;
+	char *b = buf, *be = buf + size - 1;
+	size_t n;
+
+	while (*p && b < be) {
+		if (*p == '<' && (unsigned char)p[1] < 128 && (seq = colors[ (unsigned char)p[1] ]) && (end = strchr(p + 2, '>'))) {
+			if (!strip) {
+				n = strlen(seq);
+				if (n > (size_t)(be - b)) n = be - b;
+				memcpy(b, seq, n);
+				b += n;
+			}
+			p = end + 1;
+		} else {
+			*b++ = *p++;
+		}
+	}
 	*b = 0;
-	be += 4095;
-	daemond_term_color_t * col;
-	while (*p) {
-		switch(*p) {
-			case '<':
-				if ((end = strchr(p,'>'))) {
-					p++;
-					//debug("matched color: %-.*s", end-p,p );
-					for (col = colors; col->n > 0; col++) {
-						if ( strncmp( col->n, p, strlen( col->n ) ) == 0 ) {
-							//debug("is: %s",col->n);
-							//debug("buffer:  +%d: '%s'",b-buf,buf);
-							strncat(b,"\033[",  be-b ); b+= 2;
-							//debug("buffer:  +%d: '%s'",b-buf,buf);
-							strncat(b,col->seq, be-b);  b+= strlen(col->seq);
-							//debug("buffer:  +%d: '%s'",b-buf,buf);
-							strncat(b,"m",      be-b);  b+= 1;
-							//debug("buffer:  +%d: '%s'",b-buf,buf);
-							break;
-						}
-					}
-					if (col->n == NULL) {
-						p--;
-						strncat(b, p, end-p+1 ); b+= end-p+1;
-						//debug("buffer:  +%d: '%s'",b-buf,buf);
-						p = end+1;
-						break;
-					} else {
-						//debug("last color: %s",col->n);
-					}
-					p = end+1;
-					break;
-				} else {
-					*b++ = *p++;
-					break;
-				}
-			default:
-				//debug("copy %c -> +%d",*p,b-buf);
-				*b++ = *p++;
+	return b - buf;
+}
+
+// cached daemond_colorize, buf is used only when fmt can't be cached
+static const char * daemond_color_fmt(const char * fmt, int strip, char * buf, size_t size) {
+	uintptr_t h = ((uintptr_t)fmt >> 3) * 2654435761u;
+	daemond_color_entry * e;
+	const char * key, * out;
+	char * src, * dst;
+	size_t len;
+	int i;
+
+	for (i=0; i < 8; i++) {
+		e = &_G_color_cache[ strip ? 1 : 0 ][ (h + i) & (DAEMOND_COLOR_CACHE - 1) ];
+		key = __atomic_load_n(&e->fmt, __ATOMIC_ACQUIRE);
+		if (key == NULL && __atomic_compare_exchange_n(&e->fmt, &key, fmt, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			len = daemond_colorize(fmt, buf, size, strip);
+			if ((src = strdup(fmt)) && (dst = malloc(len + 1))) {
+				memcpy(dst, buf, len + 1);
+				e->src = src;
+				__atomic_store_n(&e->out, dst, __ATOMIC_RELEASE);
+			} else {
+				free(src);
+			}
+			return buf;
+		}
+		if (key == fmt) {
+			if ((out = __atomic_load_n(&e->out, __ATOMIC_ACQUIRE)) && strcmp(e->src, fmt) == 0)
+				return out;
+			break;
 		}
 	}
-	*b++ = 0;
-	//debug("composed buffer: '%s'",buf);
+	daemond_colorize(fmt, buf, size, strip);
+	return buf;
+}
+
+static void vcolorprintf(const char * fmt, va_list va_args) {
+	char buf[4096];
+	int strip = daemond_colors_strip();
 
-	vfprintf(stdout, buf, va_args);
-	fprintf(stdout,"\033[0m");
+	vfprintf(stdout, daemond_color_fmt(fmt, strip, buf, sizeof(buf)), va_args);
+	if (!strip)
+		fputs("\033[0m", stdout);
 	return;
 
 }
 
 static tracer_t _G_tracer = vcolorprintf;
 
+// flight recorder ring of this worker, NULL if disabled or in master
+static void * _G_flight = NULL;
+
+// tracers may be swapped while worker threads trace
+#define daemond_tracer() __atomic_load_n(&_G_tracer, __ATOMIC_ACQUIRE)
+#define daemond_tracer_debug() __atomic_load_n(&_G_tracer_debug, __ATOMIC_ACQUIRE)
+
+// tracers taking a daemond_say() record in one call rather than in pieces
+#define daemond_record_whole(t) ( (t) == daemond_record_tracer || (t) == daemond_async_tracer || (t) == daemond_log_file_tracer )
+
+// decoration of records and captured output, the flight ring doesn't get it
 static void colorprintf(const char * fmt, ...) {
-	if (_G_tracer) {
-		va_list va_args;
+	va_list va_args;
+	tracer_t tracer = daemond_tracer();
+	if (tracer) {
 		va_start(va_args,fmt);
-		_G_tracer(fmt, va_args);
+		tracer(fmt, va_args);
 		va_end(va_args);
 	}
 }
@@ -134,55 +219,142 @@ static void debug_output_default(const char * fmt, va_list va_args) {
 
 static tracer_t _G_tracer_debug = debug_output_default;
 
-static void debug_output(const char * fmt, ...) {
-	if (_G_tracer_debug) {
-		va_list va_args;
+int daemond_log_threshold = DAEMOND_LOG_DEBUG;
+
+// level of the record being traced, lets sinks map it to own severity
+static __thread int _G_log_level = -1;
+
+static void debug_output(int level, const char * fmt, ...) {
+	va_list va_args;
+	tracer_t tracer = daemond_tracer_debug();
+	if (_G_flight) {
+		va_start(va_args,fmt);
+		daemond_flight_vrecord(fmt, va_args);
+		va_end(va_args);
+	}
+	if (tracer) {
+		_G_log_level = level;
 		va_start(va_args,fmt);
-		_G_tracer_debug(fmt, va_args);
+		tracer(fmt, va_args);
 		va_end(va_args);
+		_G_log_level = -1;
+	}
+}
+
+void daemond_set_log_level(int level) {
+	daemond_log_threshold = level;
+}
+
+/*
+ * Lets burst records per interval through, then counts the rest and
+ * reports how many were suppressed once the next interval opens
+ */
+int daemond_ratelimit_pass(daemond_ratelimit * rl, int burst, double interval) {
+	double now = htime();
+	int suppressed;
+	if (now - rl->start >= interval) {
+		suppressed = rl->suppressed;
+		rl->start = now;
+		rl->count = rl->suppressed = 0;
+		if (suppressed)
+			debug_output(DAEMOND_LOG_WARN, "[%d] %d similar messages suppressed\n", getpid(), suppressed);
 	}
+	if (++rl->count <= burst)
+		return 1;
+	rl->suppressed++;
+	return 0;
 }
 
 void daemond_set_tracer(const tracer_t tracer) {
-	_G_tracer = tracer;
+	__atomic_store_n(&_G_tracer, tracer, __ATOMIC_RELEASE);
 }
 
 void daemond_set_tracer_debug(const tracer_t tracer) {
-	_G_tracer_debug = tracer;
+	__atomic_store_n(&_G_tracer_debug, tracer, __ATOMIC_RELEASE);
 }
 
-// <r><sample>test</>
-void daemond_say(daemond * d, const char * fmt, ...) {
-	va_list va_args;
+static void daemond_vsay(daemond * d, int level, const char * fmt, va_list va_args) {
+	tracer_t tracer = daemond_tracer();
 	char * p = (char *)fmt;
 	p += strlen(fmt)-1;
 
+	_G_log_level = level;
+	if (daemond_record_whole(tracer)) {
+		if (_G_flight) {
+			va_list ap;
+			va_copy(ap, va_args);
+			daemond_flight_vrecord(fmt, ap);
+			va_end(ap);
+		}
+		daemond_record_say(d, tracer, fmt, va_args, *p == '\n' ? "" : "\n");
+		_G_log_level = -1;
+		return;
+	}
 	if (d) {
 		colorprintf("<g>%s</> - ", d->name);
 	}
 
-	if (_G_tracer) {
-		va_start(va_args,fmt);
-		_G_tracer(fmt, va_args);
-		va_end(va_args);
+	if (_G_flight) {
+		va_list ap;
+		va_copy(ap, va_args);
+		daemond_flight_vrecord(fmt, ap);
+		va_end(ap);
+	}
+	if (tracer) {
+		tracer(fmt, va_args);
 	}
 
 	colorprintf("</>%s", *p == '\n' ? "" : "\n");
+	_G_log_level = -1;
+}
+
+// <r><sample>test</>
+void daemond_say(daemond * d, const char * fmt, ...) {
+	va_list va_args;
+	if (!daemond_log_enabled(DAEMOND_LOG_INFO))
+		return;
+	va_start(va_args,fmt);
+	daemond_vsay(d, DAEMOND_LOG_INFO, fmt, va_args);
+	va_end(va_args);
+}
+
+void daemond_log(daemond * d, int level, const char * fmt, ...) {
+	va_list va_args;
+	if (!daemond_log_enabled(level))
+		return;
+	va_start(va_args,fmt);
+	daemond_vsay(d, level, fmt, va_args);
+	va_end(va_args);
 }
 
 void daemond_printf(daemond * d, const char * fmt, ...) {
 	va_list va_args;
+	tracer_t tracer = daemond_tracer();
 	char * p = (char *)fmt;
 	p += strlen(fmt)-1;
 
+	if (!daemond_log_enabled(DAEMOND_LOG_INFO))
+		return;
+
+	if (_G_flight) {
+		va_start(va_args,fmt);
+		daemond_flight_vrecord(fmt, va_args);
+		va_end(va_args);
+	}
+	if (daemond_record_whole(tracer)) {
+		va_start(va_args,fmt);
+		daemond_record_say(d, tracer, fmt, va_args, "");
+		va_end(va_args);
+		return;
+	}
 	if (d) {
 		colorprintf("<g>%s</> - ", d->name);
 	}
 
-	if (_G_tracer)
+	if (tracer)
 	{
 		va_start(va_args,fmt);
-		_G_tracer(fmt, va_args);
+		tracer(fmt, va_args);
 		va_end(va_args);
 	}
 
@@ -190,717 +362,4611 @@ void daemond_printf(daemond * d, const char * fmt, ...) {
 }
 
 /*
- * Pid functions
+ * Asynchronous tracer
+ *
+ * Callers format into a thread local buffer and push the line into a bounded
+ * lock-free queue (Vyukov's sequence numbered ring), the writer thread takes
+ * ready cells in batches and hands them to writev(2)
  */
 
-static int file_exists (const char * file) {
-	struct stat sb;
-	if( stat(file, &sb) == -1 ) {
-		return errno == ENOENT ? 0 : -1;
-	} else {
-		return 1;
-	}
-}
-
-static int daemond_pid_openlocked( daemond_pid * pid, int recurse ) {
-	int r,err;
-	int created;
-	int fd;
-	int failures = 0;
-	int ready = 0;
-	const char * file = pid->pidfile;
-	struct stat sh,sf;
-	//debug("locking file %s", file);
+#define DAEMOND_ASYNC_LINE  1024
+#define DAEMOND_ASYNC_DEPTH 1024
+#define DAEMOND_ASYNC_BATCH 64
 
-	if (recurse > 5) {
-		die("Fall into recursion during lock tries");
-	}
+typedef struct {
+	size_t            seq;
+	size_t            len;
+	char              data[DAEMOND_ASYNC_LINE];
+} daemond_async_cell;
+
+static struct {
+	daemond_async_cell   * cells;
+	size_t                 mask;
+	size_t                 head;     // writer position
+	size_t                 tail;     // producers position
+	int                    fd;
+	daemond_async_policy   policy;
+	int                    strip;    // fd is not a terminal
+	unsigned long          dropped;
+	int                    running;
+	int                    respawn;  // writer was lost in fork, start it on demand
+	int                    stop;
+	int                    sleeping;
+	int                    blocked;
+	pthread_t              writer;
+	pthread_mutex_t        lock;
+	pthread_cond_t         wake;
+	pthread_cond_t         space;
+} _G_async = {
+	.fd     = -1,
+	.lock   = PTHREAD_MUTEX_INITIALIZER,
+	.wake   = PTHREAD_COND_INITIALIZER,
+	.space  = PTHREAD_COND_INITIALIZER,
+};
 
-	while(!ready) {
-		if (file_exists( file )) {
-			//debug("file `%s' exists", file);
-			fd = open(file, O_RDWR);
-			if (fd == -1) {
-				switch(errno) {
-					case ENOENT:
-						if ( ++failures < 5 ) {
-							warn("failed open, try again");
-							break;
-						} else {
-							warn ("failed open in 5 times");
-							return -1;
-						}
-					default:
-						ewarn("error too bad");
-						ready = 1;
-				}
-			} else {
-				//debug("file opened r/w");
-				ready = 1;
-			}
-		} else {
-			warn("file not exists");
-			fd = open(file, O_CREAT|O_EXCL|O_RDWR, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IROTH);
-			if (fd == -1) {
-				switch(errno) {
-					case EEXIST:
-						if ( ++failures < 5 ) {
-							warn("failed create, try again");
-							break;
-						} else {
-							warn ("failed create in 5 times");
-							return -1;
-						}
-					default:
-						ewarn("error too bad");
-						ready = 1;
-				}
-			} else {
-				debug("file created r/w; fd=%d", fd);
-				ready = 1;
-				created = 1;
-			}
-		}
+static void daemond_async_reset(void) {
+	size_t i;
+	for (i=0; i <= _G_async.mask; i++) {
+		_G_async.cells[i].seq = i;
 	}
+	_G_async.head = _G_async.tail = 0;
+	_G_async.stop = _G_async.sleeping = _G_async.blocked = 0;
+}
 
-	//debug("call flock on %d",fd);
-	r = flock(fd, LOCK_EX|LOCK_NB);
-
-	if (r == 0) {
-		//debug("flock successful");
-		if ( fstat(fd, &sh) == -1) {
-			die("Can't get stat on locked filehandle: %s", strerror(errno));
-		}
-		if ( stat( file, &sf ) == -1) {
+static void daemond_async_writev(int fd, struct iovec * iov, int n) {
+	ssize_t w;
+	struct pollfd pfd;
+	while (n > 0) {
+		w = writev(fd, iov, n > IOV_MAX ? IOV_MAX : n);
+		if (w == -1) {
 			switch(errno) {
-				case ENOENT:
-					break;
-				default:
-					die("Can't stat on file `%s': %s",file,strerror(errno));
+				case EINTR:
+					continue;
+				case EAGAIN:
+					pfd.fd = fd; pfd.events = POLLOUT;
+					poll(&pfd, 1, -1);
+					continue;
+				default: // nowhere to complain
+					return;
 			}
-			close(fd);
-			return daemond_pid_openlocked(pid, recurse + 1);
 		}
-		if ( sh.st_dev != sf.st_dev || sh.st_ino != sf.st_ino ) {
-			warn("dev/ino on file `%s' mismatch with opened filehandle. reopen", file);
-			close(fd);
-			return daemond_pid_openlocked(pid, recurse + 1);
+		while (n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++; n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
 		}
-		pid->locked = 1;
-		pid->owner = getpid();
-		pid->fd = fd;
-		pid->handle = fdopen(fd,"w+");
-		if (!pid->handle)
-			die("failed fdopen: %s",ERR);
-
-	} else {
-		err = errno;
-		warn("%d: lock failed: %s", getpid(), strerror(err));
-		close(fd);
 	}
-	return r;
 }
 
-int daemond_pid_lock(daemond_pid * pid) {
-	struct stat sb;
-	int r,err;
-	pid_t oldpid;
-	FILE *f;
-	daemond_say(pid->d, "lock %s", pid->pidfile);
-	if( stat(pid->pidfile, &sb) == -1 ) {
-		err = errno;
-		ewarn("no pid");
-		switch(err) {
-			case ENOENT:
-				r = daemond_pid_openlocked( pid, 0 );
+static void * daemond_async_writer(void * arg) {
+	struct iovec iov[DAEMOND_ASYNC_BATCH];
+	daemond_async_cell * cell;
+	size_t pos, n, i;
+
+	while (1) {
+		pos = _G_async.head;
+		for (n=0; n < DAEMOND_ASYNC_BATCH; n++) {
+			cell = &_G_async.cells[ (pos + n) & _G_async.mask ];
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + n + 1)
 				break;
-			default:
-				warn("shit!");
-		}
-	} else {
-		//debug("have pid");
-		f = fopen(pid->pidfile,"r");
-		if (!f) {
-			die("Can't open old pidfile `%s' for reading: %s",pid->pidfile, ERR);
+			iov[n].iov_base = cell->data;
+			iov[n].iov_len  = cell->len;
 		}
-		if( fscanf(f,"%d",&oldpid) > 0 ) {
-			//debug("got old pid: %d",oldpid);
-			if( kill(oldpid,0) == 0 ) {
-				//warn("old process %d still alive",oldpid);
-				pid->oldpid = oldpid;
-				return 0;
-			} else {
-				//daemond_say(pid->d, "<y>stalled pidfile old pid %d is invalid", oldpid);
+		if (n) {
+			daemond_async_writev(_G_async.fd, iov, n);
+			for (i=0; i < n; i++) {
+				cell = &_G_async.cells[ (pos + i) & _G_async.mask ];
+				__atomic_store_n(&cell->seq, pos + i + _G_async.mask + 1, __ATOMIC_RELEASE);
 			}
-		} else {
-			daemond_say(pid->d, "<r>can't read pidfile contents");
+			_G_async.head = pos + n;
+			if (__atomic_load_n(&_G_async.blocked, __ATOMIC_ACQUIRE)) {
+				pthread_mutex_lock(&_G_async.lock);
+				pthread_cond_broadcast(&_G_async.space);
+				pthread_mutex_unlock(&_G_async.lock);
+			}
+			continue;
 		}
-		r = daemond_pid_openlocked( pid, 0 );
+		if (__atomic_load_n(&_G_async.stop, __ATOMIC_ACQUIRE))
+			break;
+
+		pthread_mutex_lock(&_G_async.lock);
+		__atomic_store_n(&_G_async.sleeping, 1, __ATOMIC_SEQ_CST);
+		cell = &_G_async.cells[ pos & _G_async.mask ];
+		if (__atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST) != pos + 1 && !_G_async.stop)
+			pthread_cond_wait(&_G_async.wake, &_G_async.lock);
+		__atomic_store_n(&_G_async.sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&_G_async.lock);
 	}
-	if (pid->locked) {
-		//if (pid->verbose)
-			//debug( "pidfile `%s' was locked", pid->pidfile );
-		if( flock(pid->fd, LOCK_EX|LOCK_NB) == -1) {
-			die("Relock pidfile `%s' failed: %s",pid->pidfile, strerror(errno));
-		}
-		daemond_pid_write(pid);
-		return 1;
+	return NULL;
+}
+
+static int daemond_async_spawn(void) {
+	int r;
+	if ((r = pthread_create(&_G_async.writer, NULL, daemond_async_writer, NULL)) != 0) {
+		errno = r;
+		return -1;
 	}
+	__atomic_store_n(&_G_async.running, 1, __ATOMIC_RELEASE);
 	return 0;
 }
 
-void daemond_pid_forget(daemond_pid * pid) {
-	pid->owner = 0;
+// held across fork, so the child never gets it taken by a thread it doesn't have
+static void daemond_async_atfork_prepare(void) {
+	pthread_mutex_lock(&_G_async.lock);
 }
 
-void daemond_pid_close(daemond_pid * pid) {
-	if (pid->handle) {
-		fclose(pid->handle);
-	}
-	close(pid->fd);
-	bzero(pid,sizeof(daemond_pid));
+static void daemond_async_atfork_parent(void) {
+	pthread_mutex_unlock(&_G_async.lock);
 }
 
-void daemond_pid_write(daemond_pid * pid) {
-	if (! pid->handle )
-		die("Can't write to unopened pidfile");
-	if (! pid->locked)
-		die("Mustn't write to not locked pidfile");
-	if ( pid->owner != getpid() )
-		die("Write to pidfile allowed only to owner(%d), tried by %d", pid->owner, getpid());
-	if( fseek(pid->handle,0,SEEK_SET) == -1 )
-		die("Can't seek handle: %s",strerror(errno));
-	if( fprintf( pid->handle, "%u\n", getpid() ) == -1)
-		die("Failed to write pidfile: %s",strerror(errno));
-	if( fflush(pid->handle) == 1 )
-		die("Failed to flush pidfile: %s",ERR);
-	if ( fsync( pid->fd ) == -1 )
-		die("Failed to sync pid after write: %s",ERR);
+static void daemond_async_atfork_child(void) {
+	pthread_mutex_unlock(&_G_async.lock);
+	if (!_G_async.cells)
+		return;
+	// waiters of the conditions stayed in the parent
+	pthread_cond_init(&_G_async.wake, NULL);
+	pthread_cond_init(&_G_async.space, NULL);
+	// records queued by the parent belong to the parent's writer
+	daemond_async_reset();
+	_G_async.respawn = _G_async.running;
+	_G_async.running = 0;
 }
 
-static pid_t daemond_pid_read(daemond_pid * pid) {
-	pid_t new;
-	if (! pid->handle )
-		die("Can't read unopened pidfile");
+int daemond_async_start(int fd, size_t depth, daemond_async_policy policy) {
+	static int registered = 0;
+	size_t size = 2;
+
+	if (_G_async.running)
+		return 0;
+	if (!depth)
+		depth = DAEMOND_ASYNC_DEPTH;
+	while (size < depth) size <<= 1;
+
+	free(_G_async.cells);
+	if (!(_G_async.cells = malloc( size * sizeof(daemond_async_cell) )))
+		return -1;
+	_G_async.mask   = size - 1;
+	_G_async.fd     = fd;
+	_G_async.policy = policy;
+	_G_async.strip  = _G_colors > -1 ? !_G_colors : !isatty(fd);
+	_G_async.dropped = 0;
+	daemond_async_reset();
+
+	if (!registered) {
+		pthread_atfork(daemond_async_atfork_prepare, daemond_async_atfork_parent, daemond_async_atfork_child);
+		atexit(daemond_async_stop);
+		registered = 1;
+	}
+	return daemond_async_spawn();
+}
 
-	if ( fsync( pid->fd ) == -1 )
-		die("Failed to sync pid before read: %s",ERR);
+void daemond_async_stop(void) {
+	if (!_G_async.running)
+		return;
+	pthread_mutex_lock(&_G_async.lock);
+	__atomic_store_n(&_G_async.stop, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&_G_async.wake);
+	pthread_mutex_unlock(&_G_async.lock);
+	pthread_join(_G_async.writer, NULL);
+	_G_async.running = _G_async.respawn = 0;
+}
 
-	if( fseek(pid->handle,0,SEEK_SET) == -1 )
-		die("Can't seek handle: %s",strerror(errno));
+unsigned long daemond_async_dropped(void) {
+	return __atomic_load_n(&_G_async.dropped, __ATOMIC_RELAXED);
+}
 
-	if ( fscanf( pid->handle, "%d", &new ) != 1 )
-		die("Can't read pidfile: %s", strerror(errno));
+static void daemond_async_wait_space(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 10000000;
+	if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+
+	pthread_mutex_lock(&_G_async.lock);
+	__atomic_add_fetch(&_G_async.blocked, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&_G_async.wake);
+	pthread_cond_timedwait(&_G_async.space, &_G_async.lock, &ts);
+	__atomic_sub_fetch(&_G_async.blocked, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&_G_async.lock);
+}
 
-	if( fseek(pid->handle,0,SEEK_SET) == -1 )
-		die("Can't rewind handle: %s",strerror(errno));
+static void daemond_async_push(const char * line, size_t len) {
+	daemond_async_cell * cell;
+	size_t pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&_G_async.tail, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &_G_async.cells[ pos & _G_async.mask ];
+		seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif  = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&_G_async.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0) { // full
+			if (_G_async.policy == DAEMOND_ASYNC_DROP) {
+				__atomic_add_fetch(&_G_async.dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			daemond_async_wait_space();
+			pos = __atomic_load_n(&_G_async.tail, __ATOMIC_RELAXED);
+		}
+		else {
+			pos = __atomic_load_n(&_G_async.tail, __ATOMIC_RELAXED);
+		}
+	}
 
-	return new;
+	memcpy(cell->data, line, len);
+	cell->len = len;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&_G_async.sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&_G_async.lock);
+		pthread_cond_signal(&_G_async.wake);
+		pthread_mutex_unlock(&_G_async.lock);
+	}
+}
+
+// queues a formatted line, the writer is started again if lost in fork
+static void daemond_async_line(const char * line, size_t len) {
+	if (!__atomic_load_n(&_G_async.running, __ATOMIC_ACQUIRE)) {
+		if (_G_async.respawn && __atomic_exchange_n(&_G_async.respawn, 0, __ATOMIC_ACQ_REL)) {
+			if (daemond_async_spawn() == -1)
+				_G_async.cells = NULL;
+		}
+		if (!__atomic_load_n(&_G_async.running, __ATOMIC_ACQUIRE)) {
+			if (write(_G_async.fd > -1 ? _G_async.fd : STDOUT_FILENO, line, len) == -1) {
+				// nowhere to complain
+			}
+			return;
+		}
+	}
+	daemond_async_push(line, len < DAEMOND_ASYNC_LINE ? len : DAEMOND_ASYNC_LINE);
 }
 
+void daemond_async_tracer(const char * fmt, va_list va_args) {
+	static __thread char line[DAEMOND_ASYNC_LINE];
+	char buf[4096];
+	int len;
 
-void daemond_pid_relock(daemond_pid * pid) {
-	if (pid->locked) {
-		if( flock(pid->fd,LOCK_EX|LOCK_NB) == -1)
-			die("Relock pid from %d to %d failed: %s",pid->owner, getpid(), ERR);
-		pid->owner = getpid();
-		daemond_pid_write(pid);
+	len = vsnprintf(line, sizeof(line) - 4, daemond_color_fmt(fmt, _G_async.strip, buf, sizeof(buf)), va_args);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(line) - 5)
+		len = sizeof(line) - 5;
+	if (!_G_async.strip) {
+		memcpy(line + len, "\033[0m", 4);
+		len += 4;
 	}
+	daemond_async_line(line, len);
 }
 
 /*
- * Cli functions
+ * Record tracer
+ *
+ * daemond_say() and friends hand the whole record to it, name prefix and
+ * colour reset included, so it is formatted into a growable thread local
+ * buffer and leaves by one write(2). Records up to PIPE_BUF never interleave
+ * on a pipe, no lock is taken on the way
  */
 
-static double htime() {
-	struct timeval tp;
-	gettimeofday(&tp,NULL);
-	return ((double)tp.tv_usec / 1000000) + ((double)tp.tv_sec);
+typedef struct {
+	char * line;
+	size_t line_size;
+	char * fmt;
+	size_t fmt_size;
+} daemond_record_buf;
+
+static int _G_record_fd = STDOUT_FILENO;
+static int _G_record_tty = -1;
+static __thread daemond_record_buf * _G_record = NULL;
+static pthread_key_t _G_record_key;
+static pthread_once_t _G_record_once = PTHREAD_ONCE_INIT;
+
+static void daemond_record_free(void * p) {
+	daemond_record_buf * r = p;
+	free(r->line);
+	free(r->fmt);
+	free(r);
 }
 
+static void daemond_record_key(void) {
+	pthread_key_create(&_G_record_key, daemond_record_free);
+}
 
-static int kill_ext(int pidgrp, int sig) {
-	pid_t pid;
-	pid_t grp;
-	if (pidgrp < 0) {
-		pid = -pidgrp;
-		grp = getpgid(pid);
-		if (grp != -1) {
-			return -1; // also have good errno
-		}
-		debug("detected grp %d for pid %d",grp,pid);
-		return killpg(grp,sig);
-	} else {
-		pid = pidgrp;
-		return kill(pid,sig);
+// buffers of the calling thread, released as the thread exits
+static daemond_record_buf * daemond_record_buf_get(void) {
+	if (_G_record)
+		return _G_record;
+	if (!(_G_record = calloc(1, sizeof(daemond_record_buf))))
+		return NULL;
+	pthread_once(&_G_record_once, daemond_record_key);
+	pthread_setspecific(_G_record_key, _G_record);
+	return _G_record;
+}
+
+static int daemond_record_grow(char ** buf, size_t * size, size_t need) {
+	size_t n = *size ? *size : 256;
+	char * p;
+	if (need <= *size)
+		return 0;
+	while (n < need)
+		n *= 2;
+	if (!(p = realloc(*buf, n)))
+		return -1;
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+static int daemond_record_strip(void) {
+	int tty;
+	if (_G_colors > -1)
+		return !_G_colors;
+	if ((tty = __atomic_load_n(&_G_record_tty, __ATOMIC_RELAXED)) == -1) {
+		tty = isatty(__atomic_load_n(&_G_record_fd, __ATOMIC_RELAXED));
+		__atomic_store_n(&_G_record_tty, tty, __ATOMIC_RELAXED);
 	}
+	return !tty;
 }
 
-static int daemond_kill_wait( pid_t inpid, int sig, double interval ) {
-	double at = htime();
-	//debug("kill_wait(%d,%d,%0.2f)",inpid,sig,interval);
-	pid_t pid = (inpid < 0) ? -inpid : inpid;
-	//debug("kill pid %d and wait for %0.2f...",pid,interval);
-	if( kill_ext(inpid,sig) == 0 ) {
-		//debug("kill_ext successful (process exists)");
-		while (1) {
-			usleep(100000);
-			if(kill(pid,0) == -1) {
-				//debug("kill failed: %s",ERR);
-				return errno == ESRCH ? 1 : -1;
-			}
-			if (htime() - at > interval) {
-				//debug("interval overflow");
-				return 0;
-			}
-		}
-	} else {
-		//debug("kill_ext failed: %s", ERR);
-		switch(errno) {
-			case ESRCH:
-				return 1;
-			default:
-				ewarn("kill %d",pid);
-				return -1;
-		}
+// formats fmt after len bytes of the line, returns the new length or -1
+static int daemond_record_vappend(daemond_record_buf * r, int len, int strip, const char * fmt, va_list va_args) {
+	const char * cfmt;
+	va_list ap;
+	int n;
+
+	// a tag never grows twice its length, so the translation is never cut
+	if (len < 0 || daemond_record_grow(&r->fmt, &r->fmt_size, strlen(fmt) * 2 + 1) == -1)
+		return -1;
+	if (daemond_record_grow(&r->line, &r->line_size, len + 1) == -1)
+		return -1;
+	cfmt = daemond_color_fmt(fmt, strip, r->fmt, r->fmt_size);
+
+	va_copy(ap, va_args);
+	n = vsnprintf(r->line + len, r->line_size - len, cfmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return -1;
+	if ((size_t)len + n >= r->line_size) {
+		if (daemond_record_grow(&r->line, &r->line_size, (size_t)len + n + 1) == -1)
+			return -1;
+		va_copy(ap, va_args);
+		vsnprintf(r->line + len, r->line_size - len, cfmt, ap);
+		va_end(ap);
 	}
-	//debug("fallback");
-	return 0;
+	return len + n;
 }
 
-pid_t daemond_cli_kill(daemond_cli * cli, pid_t pid) {
-	//debug("killing %d...",pid);
-	//float t;
-	if (kill(pid,0) == 0) {
-		daemond_say(cli->d,"<y>killing %d with <b><w>INT</>", pid);
-		if ( daemond_kill_wait(pid, SIGINT, 1 ) ) {
-			//debug("Gone after SIGINT");
-		} else {
-			daemond_say(cli->d,"<y>killing %d with <b><w>TERM</>", pid);
-			if( daemond_kill_wait(pid, SIGTERM, cli->d->force_quit ? cli->d->force_quit * 2 : 1 ) ) {
-				//debug("Gone after SIGTERM");
-			} else {
-				daemond_say(cli->d,"<y>killing %d group with <r><b>KILL</>", pid);
-				//debug("Not gone after TERM, send KILL to group");
-				if( daemond_kill_wait(-pid, SIGKILL, cli->d->force_quit ? cli->d->force_quit * 2 : 1 ) ) {
-					//debug("Gone after SIGKILL");
-				} else {
-					warn("WTF? Not gone after KILL!");
-					daemond_say(cli->d,"<r>Process not gone after KILL. Giving up");
-					return 0;
-				}
+static int daemond_record_append(daemond_record_buf * r, int len, int strip, const char * fmt, ...) {
+	va_list va_args;
+	va_start(va_args, fmt);
+	len = daemond_record_vappend(r, len, strip, fmt, va_args);
+	va_end(va_args);
+	return len;
+}
+
+static void daemond_record_write(const char * p, size_t len) {
+	int fd = __atomic_load_n(&_G_record_fd, __ATOMIC_RELAXED);
+	struct pollfd pfd;
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
 			}
+			return; // nowhere to complain
 		}
-		daemond_say(cli->d,"<g>process %d is gone</>",pid);
-
-	} else {
-		return errno == ESRCH ? pid : 0;
+		p += w;
+		len -= w;
 	}
-	return pid;
 }
 
-void daemond_cli_usage(daemond_cli * cli) {
+void daemond_record_set_fd(int fd) {
+	__atomic_store_n(&_G_record_fd, fd, __ATOMIC_RELAXED);
+	__atomic_store_n(&_G_record_tty, -1, __ATOMIC_RELAXED);
+}
 
+static void daemond_record_pass(tracer_t tracer, const char * fmt, ...) {
+	va_list va_args;
+	va_start(va_args, fmt);
+	tracer(fmt, va_args);
+	va_end(va_args);
 }
 
-void daemond_cli_run(daemond_cli * cli, int argc, char *argv[]) {
-	//debug("name = %s",cli->d->name);
-	if (!cli->d->use_pid) {
-		daemond_say(cli->d,"<r>use_pid required for CLI");
-		exit(255);
+/*
+ * One record: "name - " prefix, the message, reset and tail. The async
+ * tracer gets it as a single queue cell and the log file as a single
+ * call too, so lines of concurrent threads never mix and a drop always
+ * takes a whole line
+ */
+static void daemond_record_say(daemond * d, tracer_t tracer, const char * fmt, va_list va_args, const char * tail) {
+	daemond_record_buf * r = daemond_record_buf_get();
+	int async = tracer == daemond_async_tracer, strip = async ? _G_async.strip : tracer == daemond_log_file_tracer || daemond_record_strip();
+	int len = 0, end;
+
+	if (!r)
+		return;
+	if (d)
+		len = daemond_record_append(r, len, strip, "<g>%s</> - ", d->name);
+	len = daemond_record_vappend(r, len, strip, fmt, va_args);
+	len = daemond_record_append(r, len, strip, "</>%s", tail);
+	if (len <= 0)
+		return;
+	if (tracer == daemond_log_file_tracer) {
+		daemond_record_pass(tracer, "%.*s", len, r->line);
+		return;
 	}
-	daemond_pid * pid = &cli->d->pid;
-	pid_t oldpid, killed = 0;
-	char * command;
-	daemond_cli_com com;
+	if (!async) {
+		daemond_record_write(r->line, len);
+		return;
+	}
+	// cut to a cell keeping the line's end
+	if (len > DAEMOND_ASYNC_LINE) {
+		end = ( strip ? 0 : 4 ) + ( memchr(r->line + DAEMOND_ASYNC_LINE, '\n', len - DAEMOND_ASYNC_LINE) ? 1 : 0 );
+		len = DAEMOND_ASYNC_LINE;
+		memcpy(r->line + len - end, "\033[0m\n" + ( strip ? 4 : 0 ), end);
+	}
+	daemond_async_line(r->line, len);
+}
 
-	//daemond_cli_kill(cli,96202);exit(0);
+void daemond_record_tracer(const char * fmt, va_list va_args) {
+	daemond_record_buf * r = daemond_record_buf_get();
+	int len;
 
-	if (argc > 0) {
-		command = argv[0];
-		//debug("got command '%s'",command);
-	} else {
-		daemond_say(cli->d, "<r>Need command");
-		exit(255);
-	}
+	if (!r)
+		return;
+	len = daemond_record_vappend(r, 0, daemond_record_strip(), fmt, va_args);
+	if (len > 0 && !daemond_record_strip())
+		len = daemond_record_append(r, len, 0, "</>");
+	if (len > 0)
+		daemond_record_write(r->line, len);
+}
 
+/*
+ * Binary tracer
+ *
+ * Each thread appends { fmt pointer, time, raw arguments } to its own ring,
+ * nothing is formatted at log time. daemond_binlog_dump() writes the rings
+ * together with the referenced format strings, daemond_binlog_decode() turns
+ * the dump into text. Dumps are decoded on the same architecture.
+ */
 
-	if ( strcmp(command, "start") == 0 ) {
-		com = START;
-	} else
-	if ( strcmp(command, "stop") == 0 ) {
-		com = STOP;
-	} else
-	if ( strcmp(command, "restart") == 0 ) {
-		com = RESTART;
-	} else
-	if ( strcmp(command, "check") == 0 ) {
-		com = CHECK;
-	} else
-		com = EXTENDED;
+#define DAEMOND_BINLOG_MAGIC  "DAEMONDB"
+#define DAEMOND_BINLOG_RING   ( 1 << 16 )
+#define DAEMOND_BINLOG_ARGS   1024
+#define DAEMOND_BINLOG_STR    255
+#define DAEMOND_FMT_ARGS      32
+#define DAEMOND_FMT_CACHE     512
+
+typedef struct daemond_binlog_ring {
+	struct daemond_binlog_ring * next;
+	int                          id;
+	size_t                       size;  // power of 2
+	uint64_t                     head;  // bytes ever written
+	uint64_t                     tail;  // start of the oldest complete record
+	unsigned char                data[];
+} daemond_binlog_ring;
 
-	if( daemond_pid_lock(pid) ) {
-		//debug("pid locked by cli");
-	} else {
-		//debug("pid not locked (old=%d)", pid->oldpid);
-		if ((oldpid = pid->oldpid)) {
-			//debug("have old pid: %d",pid->oldpid);
-			switch(com) {
-				case STOP:
-				case RESTART:
-					killed = daemond_cli_kill(cli,oldpid);
-					if (com == STOP)
-						exit(255);
-					daemond_pid_lock(pid);
-					break;
-				case CHECK:
-					if (kill(oldpid,0) == 0) {
-						daemond_say(cli->d, "<g>running</> - pid <r>%d</>", oldpid);
-						exit(0);
-					} else {
-						daemond_say(cli->d, "<g>not running</> - stalled pidfile <r>%d</>", oldpid);
-						exit(255);
-					}
-					break;
-				case START:
-					daemond_say(cli->d, "is <b><red>already running</> (pid <red>%d</>)",oldpid);
-					exit(255);
-				default:
-					//TODO whats happen in case of EXTENDED?
-					//die("Unknown command: %s",command);
-					break;
-			}
-		} else {
-			daemond_say(cli->d, "<r>pid neither locked nor have old value</>");
-			exit(255);
-		}
-	}
+typedef struct {
+	const char      * fmt;
+	uint32_t          len;   // whole record, header included
+	uint32_t          usec;
+	int64_t           sec;
+} daemond_binlog_rec;
 
-	if ( ( com == STOP || com == CHECK ) || ( com == RESTART && !killed ) )
-		daemond_say(cli->d, "<y><b>no instance running</>");
+typedef struct {
+	const char      * fmt;
+	int               ready;
+	int               n;
+	char              types[DAEMOND_FMT_ARGS];
+} daemond_binlog_sig;
+
+static daemond_binlog_ring        * _G_binlog_rings = NULL;
+static int                          _G_binlog_ids = 0;
+static size_t                       _G_binlog_size = DAEMOND_BINLOG_RING;
+static __thread daemond_binlog_ring * _G_binlog_ring = NULL;
+static daemond_binlog_sig           _G_binlog_sigs[DAEMOND_FMT_CACHE];
 
-	if ( com == STOP || com == CHECK )
-		exit(0);
+/*
+ * Parses conversion spec starting right after '%', appends types of the
+ * consumed arguments: i - int, l - long, q - long long, j - intmax_t,
+ * z - size_t, t - ptrdiff_t, d - double, D - long double, s - string,
+ * S - wide string, p - pointer, n - %n target, and m for %m, which
+ * consumes none. Returns end of spec or NULL if not supported
+ */
+static const char * daemond_fmt_spec(const char * p, char * types, int * n, int max) {
+	char len = 0;
+	while (*p && strchr("-+ #0'", *p)) p++;
+	if (*p == '*') { if (*n < max) types[(*n)++] = 'i'; p++; }
+	else while (isdigit((unsigned char)*p)) p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') { if (*n < max) types[(*n)++] = 'i'; p++; }
+		else while (isdigit((unsigned char)*p)) p++;
+	}
+	switch (*p) {
+		case 'h': p++; if (*p == 'h') p++; break;
+		case 'l': p++; len = 'l'; if (*p == 'l') { p++; len = 'q'; } break;
+		case 'q': p++; len = 'q'; break;
+		case 'j': case 'z': case 't': case 'L': len = *p++; break;
+	}
+	if (*n >= max)
+		return NULL;
+	switch (*p) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			types[(*n)++] = len && len != 'L' ? len : 'i';
+			break;
+		case 'c':
+			types[(*n)++] = 'i';
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			types[(*n)++] = len == 'L' ? 'D' : 'd';
+			break;
+		case 's':
+			types[(*n)++] = len == 'l' ? 'S' : 's';
+			break;
+		case 'p':
+			types[(*n)++] = 'p';
+			break;
+		case 'n':
+			types[(*n)++] = 'n';
+			break;
+		case 'm':
+			types[(*n)++] = 'm';
+			break;
+		default:
+			return NULL;
+	}
+	return p + 1;
+}
 
-	if ( com != START && com != RESTART) {
-		daemond_say(cli->d, "<b><y>unknown command: <r>%s</>", command);
-		daemond_cli_usage( cli );
-		exit(0);
+// returns argument types of fmt, -1 if fmt can't be recorded
+static int daemond_fmt_types(const char * fmt, char * types) {
+	const char * p = fmt;
+	int n = 0;
+	while ((p = strchr(p, '%'))) {
+		if (*++p == '%') { p++; continue; }
+		if (!(p = daemond_fmt_spec(p, types, &n, DAEMOND_FMT_ARGS)))
+			return -1;
 	}
+	return n;
+}
 
+static daemond_binlog_sig * daemond_binlog_sig_of(const char * fmt) {
+	uintptr_t h = ((uintptr_t)fmt >> 3) * 2654435761u;
+	daemond_binlog_sig * sig;
+	const char * key;
+	int i;
+
+	for (i=0; i < 8; i++) {
+		sig = &_G_binlog_sigs[ (h + i) & (DAEMOND_FMT_CACHE - 1) ];
+		key = __atomic_load_n(&sig->fmt, __ATOMIC_ACQUIRE);
+		if (key == fmt)
+			return __atomic_load_n(&sig->ready, __ATOMIC_ACQUIRE) ? sig : NULL;
+		if (key == NULL) {
+			if (!__atomic_compare_exchange_n(&sig->fmt, &key, fmt, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return key == fmt && __atomic_load_n(&sig->ready, __ATOMIC_ACQUIRE) ? sig : NULL;
+			sig->n = daemond_fmt_types(fmt, sig->types);
+			__atomic_store_n(&sig->ready, 1, __ATOMIC_RELEASE);
+			return sig;
+		}
+	}
+	return NULL;
 }
 
 /*
- * SIG functions
+ * Strings are copied, the decoder may run in another process or after the
+ * caller's memory is gone: %ls as multibyte text of the caller's locale,
+ * %m as strerror() of errno at the call
  */
+static size_t daemond_binlog_pack(const char * fmt, va_list va_args, unsigned char * buf, size_t size) {
+	daemond_binlog_sig * sig, local;
+	unsigned char * b = buf, * be = buf + size;
+	char mb[MB_LEN_MAX];
+	const wchar_t * wstr;
+	const char * str;
+	mbstate_t ps;
+	size_t len, n;
+	int i, err = errno;
+
+	if (!(sig = daemond_binlog_sig_of(fmt))) {
+		sig = &local;
+		sig->n = daemond_fmt_types(fmt, sig->types);
+	}
 
+#define PACK(type) do { type v = va_arg(va_args, type); memcpy(b, &v, sizeof(v)); b += sizeof(v); } while (0)
+	for (i=0; i < sig->n; i++) {
+		if (be - b < 16)
+			break;
+		switch (sig->types[i]) {
+			case 'i': PACK(int);         break;
+			case 'l': PACK(long);        break;
+			case 'q': PACK(long long);   break;
+			case 'j': PACK(intmax_t);    break;
+			case 'z': PACK(size_t);      break;
+			case 't': PACK(ptrdiff_t);   break;
+			case 'd': PACK(double);      break;
+			case 'D': PACK(long double); break;
+			case 'p':
+			case 'n': PACK(void *);      break;
+			case 's':
+			case 'm':
+				str = sig->types[i] == 'm' ? strerror(err) : va_arg(va_args, const char *);
+				if (!str) str = "(null)";
+				len = strnlen(str, DAEMOND_BINLOG_STR);
+				if (len > (size_t)(be - b) - 1)
+					len = be - b - 1;
+				*b++ = (unsigned char)len;
+				memcpy(b, str, len);
+				b += len;
+				break;
+			case 'S':
+				wstr = va_arg(va_args, const wchar_t *);
+				if (!wstr) wstr = L"(null)";
+				memset(&ps, 0, sizeof(ps));
+				// whole characters only, an unconvertible one ends the text
+				for (len = 0; *wstr; wstr++, len += n) {
+					if ((n = wcrtomb(mb, *wstr, &ps)) == (size_t)-1
+					|| len + n > DAEMOND_BINLOG_STR || len + n > (size_t)(be - b) - 1)
+						break;
+					memcpy(b + 1 + len, mb, n);
+				}
+				*b = (unsigned char)len;
+				b += 1 + len;
+				break;
+		}
+	}
+	errno = err;
+#undef PACK
+	return b - buf;
+}
 
-/*
-volatile sig_atomic_t daemond_sig_was_received;
-volatile sig_atomic_t daemond_sig_received[NSIG];
-*/
-
-static void daemond_sig_handler(int sig) {
-	//debug("Signal %d received", sig);
-	if (sig < NSIG) {
-		daemond_sig_was_received = 1;
-		daemond_sig_received[sig]++;
+static void daemond_binlog_put(daemond_binlog_ring * r, uint64_t pos, const void * src, size_t n) {
+	size_t off = pos & (r->size - 1), first = r->size - off;
+	if (first >= n) {
+		memcpy(r->data + off, src, n);
 	} else {
-		debug("Received signal %d (%s), ignoring", sig, sys_signame[sig]);
+		memcpy(r->data + off, src, first);
+		memcpy(r->data, (const char *)src + first, n - first);
 	}
-	return;
-	/*
-	switch(sig) {
-		case SIGQUIT:
-		case SIGINT:
-			//debug("Handle sigint");
-			daemond_sig_int = 1;
-			return;
-		case SIGTERM:
-			//debug("Handle sigterm");
-			daemond_sig_term = 1;
-			return;
-		default:
-			debug("Signal %d received", sig);
-			break;
+}
+
+static void daemond_binlog_get(daemond_binlog_ring * r, uint64_t pos, void * dst, size_t n) {
+	size_t off = pos & (r->size - 1), first = r->size - off;
+	if (first >= n) {
+		memcpy(dst, r->data + off, n);
+	} else {
+		memcpy(dst, r->data + off, first);
+		memcpy((char *)dst + first, r->data, n - first);
 	}
-	exit(255);
-	*/
 }
 
-//#include <sys/ucontext.h>
+static daemond_binlog_ring * daemond_binlog_ring_new(void) {
+	daemond_binlog_ring * r;
+	if (!(r = calloc(1, sizeof(daemond_binlog_ring) + _G_binlog_size)))
+		return NULL;
+	r->size = _G_binlog_size;
+	r->id   = __atomic_add_fetch(&_G_binlog_ids, 1, __ATOMIC_RELAXED);
+	r->next = __atomic_load_n(&_G_binlog_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&_G_binlog_rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return r;
+}
 
-typedef struct {
-	int     signo;
-	char   *signame;
-	int     flags;
-	char   *name;
-	void  (*handler)(int);
-	//void  (*sihandler)(int, struct __siginfo *, ucontext_t *);
-	void  (*sihandler)(int, struct __siginfo *, void *);
-} daemond_sig_t;
+void daemond_binlog_set_ring_size(size_t size) {
+	size_t s = 1024;
+	while (s < size) s <<= 1;
+	_G_binlog_size = s;
+}
 
-daemond_sig_t signals[] = {
+void daemond_binlog_tracer(const char * fmt, va_list va_args) {
+	unsigned char args[DAEMOND_BINLOG_ARGS];
+	daemond_binlog_ring * r;
+	daemond_binlog_rec rec, old;
+	struct timespec ts;
+
+	if (!(r = _G_binlog_ring) && !(r = _G_binlog_ring = daemond_binlog_ring_new()))
+		return;
+
+#ifdef CLOCK_REALTIME_COARSE
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+	rec.fmt  = fmt;
+	rec.sec  = ts.tv_sec;
+	rec.usec = ts.tv_nsec / 1000;
+	rec.len  = sizeof(rec) + daemond_binlog_pack(fmt, va_args, args, sizeof(args));
+	if (rec.len > r->size)
+		return;
+
+	while (r->head + rec.len - r->tail > r->size) {
+		daemond_binlog_get(r, r->tail, &old, sizeof(old));
+		__atomic_store_n(&r->tail, r->tail + old.len, __ATOMIC_RELEASE);
+	}
+	daemond_binlog_put(r, r->head, &rec, sizeof(rec));
+	daemond_binlog_put(r, r->head + sizeof(rec), args, rec.len - sizeof(rec));
+	__atomic_store_n(&r->head, r->head + rec.len, __ATOMIC_RELEASE);
+}
+
+static int daemond_binlog_write(int fd, const void * buf, size_t n) {
+	ssize_t w;
+	while (n > 0) {
+		if ((w = write(fd, buf, n)) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf = (const char *)buf + w;
+		n -= w;
+	}
+	return 0;
+}
+
+int daemond_binlog_dump(int fd) {
+	daemond_binlog_ring * r;
+	daemond_binlog_rec rec;
+	unsigned char args[DAEMOND_BINLOG_ARGS];
+	const char ** seen;
+	uint64_t pos, head;
+	uint32_t u32, pid = getpid(), id;
+	size_t nseen = 4096, h;
+	int records = 0;
+
+	if (!(seen = calloc(nseen, sizeof(char *))))
+		return -1;
+	u32 = sizeof(void *);
+	if (daemond_binlog_write(fd, DAEMOND_BINLOG_MAGIC, 8) == -1 || daemond_binlog_write(fd, &u32, 4) == -1)
+		goto fail;
+
+	for (r = __atomic_load_n(&_G_binlog_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		pos  = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		id   = r->id;
+		while (pos < head) {
+			daemond_binlog_get(r, pos, &rec, sizeof(rec));
+			if (rec.len < sizeof(rec) || rec.len - sizeof(rec) > DAEMOND_BINLOG_ARGS || !rec.fmt)
+				break;
+			daemond_binlog_get(r, pos + sizeof(rec), args, rec.len - sizeof(rec));
+			if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > pos) { // overwritten meanwhile
+				pos = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+				continue;
+			}
+			pos += rec.len;
+
+			// format strings are written once, before the first record using them
+			for (h = ((uintptr_t)rec.fmt >> 3) & (nseen - 1); seen[h] && seen[h] != rec.fmt; h = (h + 1) & (nseen - 1));
+			if (!seen[h]) {
+				seen[h] = rec.fmt;
+				u32 = strlen(rec.fmt);
+				if (daemond_binlog_write(fd, "F", 1) == -1
+				|| daemond_binlog_write(fd, &rec.fmt, sizeof(rec.fmt)) == -1
+				|| daemond_binlog_write(fd, &u32, 4) == -1
+				|| daemond_binlog_write(fd, rec.fmt, u32) == -1)
+					goto fail;
+			}
+			if (daemond_binlog_write(fd, "R", 1) == -1
+			|| daemond_binlog_write(fd, &pid, 4) == -1
+			|| daemond_binlog_write(fd, &id, 4) == -1
+			|| daemond_binlog_write(fd, &rec, sizeof(rec)) == -1
+			|| daemond_binlog_write(fd, args, rec.len - sizeof(rec)) == -1)
+				goto fail;
+			records++;
+		}
+	}
+	free(seen);
+	return records;
+
+	fail:
+	free(seen);
+	return -1;
+}
+
+// formats one record into buf, returns its length or -1 if args don't match fmt
+static int daemond_binlog_format(char * buf, size_t size, const char * fmt, const unsigned char * a, size_t alen) {
+	const unsigned char * ae = a + alen;
+	const char * p = fmt, * pct, * end;
+	char spec[64], types[DAEMOND_FMT_ARGS], str[DAEMOND_BINLOG_STR + 1], * s;
+	char * b = buf, * be = buf + size - 1;
+	int n, i, star;
+	size_t len;
+
+#define OUT(...) do { int w = snprintf(b, be - b + 1, __VA_ARGS__); b += w < 0 ? 0 : w > be - b ? be - b : w; } while (0)
+	while ((pct = strchr(p, '%'))) {
+		OUT("%.*s", (int)(pct - p), p);
+		if (pct[1] == '%') {
+			OUT("%%");
+			p = pct + 2;
+			continue;
+		}
+		n = 0;
+		if (!(end = daemond_fmt_spec(pct + 1, types, &n, DAEMOND_FMT_ARGS)) || end - pct >= (int)sizeof(spec) - 24)
+			return -1;
+		// width and precision given by '*' are put into spec as numbers
+		for (s = spec, p = pct, i = 0; p < end; p++) {
+			if (*p == '*') {
+				if (ae - a < (int)sizeof(int)) return -1;
+				memcpy(&star, a, sizeof(int)); a += sizeof(int); i++;
+				s += sprintf(s, "%d", star);
+			} else {
+				*s++ = *p;
+			}
+		}
+		*s = 0;
+		p = end;
+
+#define ARG(type) ({ type v; if (ae - a < (int)sizeof(v)) return -1; memcpy(&v, a, sizeof(v)); a += sizeof(v); v; })
+		switch (i < n ? types[i] : 0) {
+			case 'i': OUT(spec, ARG(int));         break;
+			case 'l': OUT(spec, ARG(long));        break;
+			case 'q': OUT(spec, ARG(long long));   break;
+			case 'j': OUT(spec, ARG(intmax_t));    break;
+			case 'z': OUT(spec, ARG(size_t));      break;
+			case 't': OUT(spec, ARG(ptrdiff_t));   break;
+			case 'd': OUT(spec, ARG(double));      break;
+			case 'D': OUT(spec, ARG(long double)); break;
+			case 'p': OUT(spec, ARG(void *));      break;
+			case 'n': ARG(void *);                 break;
+			case 'S': // packed as multibyte, "%ls" prints as "%s"
+				s[-2] = 's';
+				s[-1] = 0;
+				/* fallthrough */
+			case 'm': // packed as text, "%-20m" prints as "%-20s"
+				if (types[i] == 'm')
+					s[-1] = 's';
+				/* fallthrough */
+			case 's':
+				if (ae - a < 1 || ae - a - 1 < *a) return -1;
+				len = *a++;
+				memcpy(str, a, len); str[len] = 0; a += len;
+				OUT(spec, str);
+				break;
+		}
+#undef ARG
+	}
+	OUT("%s", p);
+#undef OUT
+	return b - buf;
+}
+
+int daemond_binlog_decode(int fd, FILE * out, int colors) {
+	FILE * in;
+	char magic[8], tag, ** fmts = NULL, buf[4096], text[8192];
+	const char ** keys = NULL;
+	unsigned char args[DAEMOND_BINLOG_ARGS];
+	daemond_binlog_rec rec;
+	uint32_t u32, pid, id;
+	size_t nfmts = 0, i, alen;
+	const char * key;
+	int records = 0, bol = 1, len;
+	char * f;
+
+	if (!(in = fdopen(dup(fd), "r")))
+		return -1;
+	if (fread(magic, 8, 1, in) != 1 || memcmp(magic, DAEMOND_BINLOG_MAGIC, 8) != 0
+	|| fread(&u32, 4, 1, in) != 1 || u32 != sizeof(void *)) {
+		fclose(in);
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (fread(&tag, 1, 1, in) == 1) {
+		if (tag == 'F') {
+			if (fread(&key, sizeof(key), 1, in) != 1 || fread(&u32, 4, 1, in) != 1 || !(f = malloc(u32 + 1)))
+				break;
+			if (fread(f, 1, u32, in) != u32) { free(f); break; }
+			f[u32] = 0;
+			fmts = realloc(fmts, (nfmts + 1) * sizeof(char *));
+			keys = realloc(keys, (nfmts + 1) * sizeof(char *));
+			fmts[nfmts] = f; keys[nfmts++] = key;
+		}
+		else if (tag == 'R') {
+			if (fread(&pid, 4, 1, in) != 1 || fread(&id, 4, 1, in) != 1 || fread(&rec, sizeof(rec), 1, in) != 1)
+				break;
+			alen = rec.len - sizeof(rec);
+			if (rec.len < sizeof(rec) || alen > DAEMOND_BINLOG_ARGS || fread(args, 1, alen, in) != alen)
+				break;
+			for (i=0; i < nfmts && keys[i] != rec.fmt; i++);
+			if (i == nfmts)
+				break;
+			if (bol)
+				fprintf(out, "%lld.%06u [%u:%u] ", (long long)rec.sec, rec.usec, pid, id);
+			daemond_colorize(fmts[i], buf, sizeof(buf), !colors);
+			if ((len = daemond_binlog_format(text, sizeof(text), buf, args, alen)) == -1)
+				len = snprintf(text, sizeof(text), "<undecodable record for \"%s\">\n", fmts[i]);
+			fwrite(text, 1, len, out);
+			if (colors)
+				fputs("\033[0m", out);
+			bol = len > 0 && text[len - 1] == '\n';
+			records++;
+		}
+		else break;
+	}
+
+	for (i=0; i < nfmts; i++) free(fmts[i]);
+	free(fmts);
+	free(keys);
+	fclose(in);
+	return records;
+}
+
+/*
+ * Flight recorder
+ *
+ * Every slot has a ring of fixed size records in MAP_SHARED memory, set up
+ * by master before the first fork. Workers put there what they trace in
+ * binlog encoding along with a copy of the format text, appends take one
+ * atomic increment. When a worker dies abnormally master decodes its ring,
+ * so the last events before a crash are known without any logging I/O
+ * during normal operation
+ */
+
+#define DAEMOND_FLIGHT_REC 256
+
+// format text is copied, dump runs in master where worker's pointers mean nothing
+#define DAEMOND_FLIGHT_FMT (DAEMOND_FLIGHT_REC - 88)
+
+typedef struct {
+	uint64_t          seq;   // index + 1 once the record is complete
+	int64_t           sec;
+	uint32_t          usec;
+	uint16_t          flen;  // format text at data, NUL terminated
+	uint16_t          len;   // packed args after it
+	unsigned char     data[ DAEMOND_FLIGHT_REC - 24 ];
+} daemond_flight_rec;
+
+typedef struct {
+	uint64_t          head;
+	uint64_t          records;
+	daemond_flight_rec rec[];
+} daemond_flight_ring;
+
+static void daemond_flight_vrecord(const char * fmt, va_list va_args) {
+	daemond_flight_ring * ring = _G_flight;
+	daemond_flight_rec * rec;
+	struct timespec ts;
+	uint64_t idx;
+
+	idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	rec = &ring->rec[ idx % ring->records ];
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+#ifdef CLOCK_REALTIME_COARSE
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+	rec->flen = strnlen(fmt, DAEMOND_FLIGHT_FMT - 1);
+	memcpy(rec->data, fmt, rec->flen);
+	rec->data[rec->flen] = 0;
+	rec->sec  = ts.tv_sec;
+	rec->usec = ts.tv_nsec / 1000;
+	rec->len  = daemond_binlog_pack(fmt, va_args, rec->data + rec->flen + 1, sizeof(rec->data) - rec->flen - 1);
+	__atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void daemond_flight(const char * fmt, ...) {
+	va_list va_args;
+	if (!_G_flight)
+		return;
+	va_start(va_args,fmt);
+	daemond_flight_vrecord(fmt, va_args);
+	va_end(va_args);
+}
+
+/*
+ * Pid functions
+ */
+
+static int file_exists (const char * file) {
+	struct stat sb;
+	if( stat(file, &sb) == -1 ) {
+		return errno == ENOENT ? 0 : -1;
+	} else {
+		return 1;
+	}
+}
+
+/*
+ * With pid->ofd set the file is locked by open file description locks,
+ * which are shared over fork like flock ones but don't mix with them, and
+ * written by a single pwrite. Readers see the page cache, so the pid is
+ * only synced when asked to be durable. Kernels and filesystems without
+ * them answer EINVAL, then flock is used; that is decided on every try,
+ * so all instances sharing the file agree on the kind
+ */
+static int daemond_pid_trylock( daemond_pid * pid, int fd ) {
+#ifdef F_OFD_SETLK
+	if (pid->ofd) {
+		struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+		if (fcntl(fd, F_OFD_SETLK, &fl) == 0)
+			return 0;
+		if (errno != EINVAL)
+			return -1;
+		debug("No OFD locks on `%s', using flock", pid->pidfile);
+	}
+#endif
+	return flock(fd, LOCK_EX|LOCK_NB);
+}
+
+// -1 if there is no pid in the file
+static pid_t daemond_pid_pread( int fd ) {
+	char buf[32], *end;
+	ssize_t got;
+	long v;
+	while ((got = pread(fd, buf, sizeof(buf) - 1, 0)) == -1 && errno == EINTR);
+	if (got <= 0)
+		return -1;
+	buf[got] = 0;
+	v = strtol(buf, &end, 10);
+	if (end == buf || v <= 0)
+		return -1;
+	return (pid_t)v;
+}
+
+static int daemond_pid_openlocked( daemond_pid * pid, int recurse ) {
+	int r,err;
+	int created;
+	int fd;
+	int failures = 0;
+	int ready = 0;
+	const char * file = pid->pidfile;
+	struct stat sh,sf;
+	//debug("locking file %s", file);
+
+	if (recurse > 5) {
+		die("Fall into recursion during lock tries");
+	}
+
+	while(!ready) {
+		if (file_exists( file )) {
+			//debug("file `%s' exists", file);
+			fd = open(file, O_RDWR);
+			if (fd == -1) {
+				switch(errno) {
+					case ENOENT:
+						if ( ++failures < 5 ) {
+							warn("failed open, try again");
+							break;
+						} else {
+							warn ("failed open in 5 times");
+							return -1;
+						}
+					default:
+						ewarn("error too bad");
+						ready = 1;
+				}
+			} else {
+				//debug("file opened r/w");
+				ready = 1;
+			}
+		} else {
+			warn("file not exists");
+			fd = open(file, O_CREAT|O_EXCL|O_RDWR, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IROTH);
+			if (fd == -1) {
+				switch(errno) {
+					case EEXIST:
+						if ( ++failures < 5 ) {
+							warn("failed create, try again");
+							break;
+						} else {
+							warn ("failed create in 5 times");
+							return -1;
+						}
+					default:
+						ewarn("error too bad");
+						ready = 1;
+				}
+			} else {
+				debug("file created r/w; fd=%d", fd);
+				ready = 1;
+				created = 1;
+			}
+		}
+	}
+
+	//debug("call flock on %d",fd);
+	r = daemond_pid_trylock(pid, fd);
+
+	if (r == 0) {
+		//debug("flock successful");
+		if ( fstat(fd, &sh) == -1) {
+			die("Can't get stat on locked filehandle: %s", strerror(errno));
+		}
+		if ( stat( file, &sf ) == -1) {
+			switch(errno) {
+				case ENOENT:
+					break;
+				default:
+					die("Can't stat on file `%s': %s",file,strerror(errno));
+			}
+			close(fd);
+			return daemond_pid_openlocked(pid, recurse + 1);
+		}
+		if ( sh.st_dev != sf.st_dev || sh.st_ino != sf.st_ino ) {
+			warn("dev/ino on file `%s' mismatch with opened filehandle. reopen", file);
+			close(fd);
+			return daemond_pid_openlocked(pid, recurse + 1);
+		}
+		pid->locked = 1;
+		pid->owner = getpid();
+		pid->fd = fd;
+		pid->size = sh.st_size;
+		if (!pid->ofd) {
+			pid->handle = fdopen(fd,"w+");
+			if (!pid->handle)
+				die("failed fdopen: %s",ERR);
+		}
+
+	} else {
+		err = errno;
+		warn("%d: lock failed: %s", getpid(), strerror(err));
+		close(fd);
+	}
+	return r;
+}
+
+int daemond_pid_lock(daemond_pid * pid) {
+	struct stat sb;
+	int r,err,fd;
+	pid_t oldpid;
+	FILE *f;
+	daemond_say(pid->d, "lock %s", pid->pidfile);
+	if( stat(pid->pidfile, &sb) == -1 ) {
+		err = errno;
+		ewarn("no pid");
+		switch(err) {
+			case ENOENT:
+				r = daemond_pid_openlocked( pid, 0 );
+				break;
+			default:
+				warn("shit!");
+		}
+	} else if (pid->ofd) {
+		if ((fd = open(pid->pidfile, O_RDONLY|O_CLOEXEC)) == -1)
+			die("Can't open old pidfile `%s' for reading: %s",pid->pidfile, ERR);
+		oldpid = daemond_pid_pread(fd);
+		close(fd);
+		if (oldpid > 0 && kill(oldpid,0) == 0) {
+			pid->oldpid = oldpid;
+			return 0;
+		}
+		if (oldpid == -1)
+			daemond_say(pid->d, "<r>can't read pidfile contents");
+		r = daemond_pid_openlocked( pid, 0 );
+	} else {
+		//debug("have pid");
+		f = fopen(pid->pidfile,"r");
+		if (!f) {
+			die("Can't open old pidfile `%s' for reading: %s",pid->pidfile, ERR);
+		}
+		if( fscanf(f,"%d",&oldpid) > 0 ) {
+			//debug("got old pid: %d",oldpid);
+			if( kill(oldpid,0) == 0 ) {
+				//warn("old process %d still alive",oldpid);
+				pid->oldpid = oldpid;
+				return 0;
+			} else {
+				//daemond_say(pid->d, "<y>stalled pidfile old pid %d is invalid", oldpid);
+			}
+		} else {
+			daemond_say(pid->d, "<r>can't read pidfile contents");
+		}
+		r = daemond_pid_openlocked( pid, 0 );
+	}
+	if (pid->locked) {
+		//if (pid->verbose)
+			//debug( "pidfile `%s' was locked", pid->pidfile );
+		if( daemond_pid_trylock(pid, pid->fd) == -1) {
+			die("Relock pidfile `%s' failed: %s",pid->pidfile, strerror(errno));
+		}
+		daemond_pid_write(pid);
+		return 1;
+	}
+	return 0;
+}
+
+void daemond_pid_forget(daemond_pid * pid) {
+	pid->owner = 0;
+}
+
+void daemond_pid_close(daemond_pid * pid) {
+	if (pid->handle) {
+		fclose(pid->handle);
+	}
+	close(pid->fd);
+	bzero(pid,sizeof(daemond_pid));
+}
+
+static void daemond_pid_pwrite(daemond_pid * pid) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%u\n", getpid());
+	ssize_t w;
+	while ((w = pwrite(pid->fd, buf, len, 0)) == -1 && errno == EINTR);
+	if (w != len)
+		die("Failed to write pidfile: %s", w == -1 ? ERR : "short write");
+	if (pid->size > len) {
+		if (ftruncate(pid->fd, len) == -1)
+			die("Failed to truncate pidfile: %s",ERR);
+		pid->size = len;
+	}
+	if (pid->durable && fdatasync(pid->fd) == -1)
+		die("Failed to sync pid after write: %s",ERR);
+}
+
+void daemond_pid_write(daemond_pid * pid) {
+	if (pid->ofd) {
+		if (! pid->locked)
+			die("Mustn't write to not locked pidfile");
+		if ( pid->owner != getpid() )
+			die("Write to pidfile allowed only to owner(%d), tried by %d", pid->owner, getpid());
+		daemond_pid_pwrite(pid);
+		return;
+	}
+	if (! pid->handle )
+		die("Can't write to unopened pidfile");
+	if (! pid->locked)
+		die("Mustn't write to not locked pidfile");
+	if ( pid->owner != getpid() )
+		die("Write to pidfile allowed only to owner(%d), tried by %d", pid->owner, getpid());
+	if( fseek(pid->handle,0,SEEK_SET) == -1 )
+		die("Can't seek handle: %s",strerror(errno));
+	if( fprintf( pid->handle, "%u\n", getpid() ) == -1)
+		die("Failed to write pidfile: %s",strerror(errno));
+	if( fflush(pid->handle) == 1 )
+		die("Failed to flush pidfile: %s",ERR);
+	if ( fsync( pid->fd ) == -1 )
+		die("Failed to sync pid after write: %s",ERR);
+}
+
+static pid_t daemond_pid_read(daemond_pid * pid) {
+	pid_t new;
+	if (pid->ofd) {
+		if ((new = daemond_pid_pread(pid->fd)) == -1)
+			die("Can't read pidfile `%s'", pid->pidfile);
+		return new;
+	}
+	if (! pid->handle )
+		die("Can't read unopened pidfile");
+
+	if ( fsync( pid->fd ) == -1 )
+		die("Failed to sync pid before read: %s",ERR);
+
+	if( fseek(pid->handle,0,SEEK_SET) == -1 )
+		die("Can't seek handle: %s",strerror(errno));
+
+	if ( fscanf( pid->handle, "%d", &new ) != 1 )
+		die("Can't read pidfile: %s", strerror(errno));
+
+	if( fseek(pid->handle,0,SEEK_SET) == -1 )
+		die("Can't rewind handle: %s",strerror(errno));
+
+	return new;
+}
+
+
+void daemond_pid_relock(daemond_pid * pid) {
+	if (pid->locked) {
+		if( daemond_pid_trylock(pid, pid->fd) == -1)
+			die("Relock pid from %d to %d failed: %s",pid->owner, getpid(), ERR);
+		pid->owner = getpid();
+		daemond_pid_write(pid);
+	}
+}
+
+/*
+ * Status file
+ */
+
+// process start in clock ticks since boot, 0 if unknown
+static uint64_t daemond_proc_start(pid_t pid) {
+	char path[64], buf[1024], *p;
+	unsigned long long ticks;
+	ssize_t got;
+	int fd, i;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return 0;
+	got = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (got <= 0)
+		return 0;
+	buf[got] = 0;
+	// comm may contain anything, fields count from its closing paren
+	if (!(p = strrchr(buf, ')')))
+		return 0;
+	for (i = 2; i < 22 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p + 1, "%llu", &ticks) != 1)
+		return 0;
+	return ticks;
+}
+
+static void daemond_status_begin(daemond_status * st) {
+	__atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void daemond_status_end(daemond_status * st) {
+	st->generation++;
+	__atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void daemond_status_init(daemond * d) {
+	size_t size = sizeof(daemond_status) + d->children_max * sizeof(daemond_status_slot);
+	daemond_status * st;
+	int fd;
+
+	if ((fd = open(d->status_file, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1)
+		die("Can't open status file `%s': %s", d->status_file, ERR);
+	if (ftruncate(fd, size) == -1)
+		die("Can't size status file `%s': %s", d->status_file, ERR);
+	st = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (st == MAP_FAILED)
+		die("Can't map status file `%s': %s", d->status_file, ERR);
+	close(fd);
+
+	st->seq &= ~1U; // left odd by a crashed predecessor
+	daemond_status_begin(st);
+	memset((char *)st + offsetof(daemond_status, slots), 0, size - offsetof(daemond_status, slots));
+	st->magic       = DAEMOND_STATUS_MAGIC;
+	st->version     = DAEMOND_STATUS_VERSION;
+	st->slots       = d->children_max;
+	st->pid         = getpid();
+	st->started     = time(NULL);
+	st->start_ticks = daemond_proc_start(getpid());
+	st->state       = DAEMOND_STATE_RUNNING;
+	daemond_status_end(st);
+	d->status = st;
+}
+
+static void daemond_status_slot_set(daemond * d, int slot, pid_t pid, int state, int status) {
+	daemond_status * st = d->status;
+	if (!st || slot < 0)
+		return;
+	daemond_status_begin(st);
+	if (state == DAEMOND_STATE_RUNNING) {
+		st->slot[slot].started = time(NULL);
+		st->slot[slot].forks++;
+		st->slot[slot].threads         = d->health ? d->threads_per_child : 0;
+		st->slot[slot].threads_running = 0;
+		st->slot[slot].thread_restarts = 0;
+	}
+	else {
+		st->slot[slot].status = status;
+	}
+	st->slot[slot].pid   = pid;
+	st->slot[slot].state = state;
+	st->running          = d->children_running;
+	daemond_status_end(st);
+}
+
+static void daemond_status_master_set(daemond * d, int state) {
+	daemond_status * st = d->status;
+	if (!st)
+		return;
+	daemond_status_begin(st);
+	st->state   = state;
+	st->running = d->children_running;
+	daemond_status_end(st);
+}
+
+int daemond_status_load(const char * path, daemond_status * st, size_t size) {
+	const daemond_status * map;
+	struct stat sb;
+	uint32_t seq;
+	int fd, tries;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(daemond_status)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	if (size > (size_t)sb.st_size)
+		size = sb.st_size;
+	for (tries = 0; tries < 10000; tries++) {
+		seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(st, map, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+	munmap((void *)map, sb.st_size);
+	if (tries == 10000) {
+		errno = EAGAIN; // master died in the middle of update
+		return -1;
+	}
+	if (st->magic != DAEMOND_STATUS_MAGIC || st->version != DAEMOND_STATUS_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+	return st->slots;
+}
+
+int daemond_status_alive(const daemond_status * st) {
+	uint64_t ticks;
+	if (st->state == DAEMOND_STATE_STOPPED || st->pid <= 0 || ( kill(st->pid, 0) == -1 && errno == ESRCH ))
+		return 0;
+	ticks = daemond_proc_start(st->pid);
+	return !ticks || !st->start_ticks || ticks == st->start_ticks;
+}
+
+/*
+ * Instance socket
+ *
+ * Binding an abstract socket is atomic and the name goes away together with
+ * the last process holding it, so there is no stale state to clean up and
+ * no filesystem I/O. Master accepts one line commands on it
+ */
+
+#ifdef __linux__
+
+static socklen_t daemond_lock_addr(daemond * d, struct sockaddr_un * sa) {
+	int len;
+	bzero(sa, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	len = snprintf(sa->sun_path + 1, sizeof(sa->sun_path) - 1, "daemond/%s", d->name);
+	if (len >= (int)sizeof(sa->sun_path) - 1)
+		die("Name `%s' is too long for instance socket", d->name);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+// 1 if the instance lock is ours now, 0 if it is held by someone else
+int daemond_lock_socket(daemond * d) {
+	struct sockaddr_un sa;
+	socklen_t len = daemond_lock_addr(d, &sa);
+	int fd;
+
+	if (d->lock_fd > -1)
+		return 1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1)
+		die("Can't create instance socket: %s", ERR);
+	if (bind(fd, (struct sockaddr *)&sa, len) == -1) {
+		if (errno != EADDRINUSE)
+			die("Can't bind instance socket: %s", ERR);
+		close(fd);
+		return 0;
+	}
+	if (listen(fd, 16) == -1)
+		die("Can't listen on instance socket: %s", ERR);
+	d->lock_fd = fd;
+	return 1;
+}
+
+/*
+ * Sends a command to the running master and reads the answer until master
+ * closes the connection. It does so right after answering, except for stop,
+ * which is answered at once but closed only by master's exit. eof tells
+ * whether the answer is complete, -1 if nobody answered at all
+ */
+// connected socket with the command sent, -1 if nobody listens
+static int daemond_control_send(daemond * d, const char * cmd) {
+	struct sockaddr_un sa;
+	socklen_t len = daemond_lock_addr(d, &sa);
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sa, len) == -1 || send(fd, cmd, strlen(cmd), MSG_NOSIGNAL) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int daemond_control_query(daemond * d, const char * cmd, char * buf, size_t size, double timeout, int * eof) {
+	struct timeval tv = { (time_t)timeout, (suseconds_t)((timeout - (time_t)timeout) * 1e6) };
+	size_t got = 0;
+	ssize_t r;
+	int fd;
+
+	*eof = 0;
+	if ((fd = daemond_control_send(d, cmd)) == -1)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (1) {
+		char drain[64];
+		// the rest of an overlong answer is read and thrown away
+		r = got < size - 1 ? read(fd, buf + got, size - 1 - got) : read(fd, drain, sizeof(drain));
+		if (r == 0) {
+			*eof = 1;
+			break;
+		}
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (got < size - 1)
+			got += r;
+	}
+	close(fd);
+	buf[got] = 0;
+	return got ? (int)got : -1;
+}
+
+int daemond_control_call(daemond * d, const char * command, char * reply, size_t size) {
+	char line[1024];
+	int eof;
+	snprintf(line, sizeof(line), "%s\n", command);
+	return daemond_control_query(d, line, reply, size, 5, &eof);
+}
+
+pid_t daemond_lock_pid(daemond * d) {
+	char buf[32];
+	if (daemond_control_call(d, "pid", buf, sizeof(buf)) == -1 || strncmp(buf, "ok ", 3) != 0)
+		return 0;
+	return (pid_t)atoi(buf + 3);
+}
+
+/*
+ * Master side
+ */
+
+#define DAEMOND_COMMANDS_MAX 32
+#define DAEMOND_STOP_WAITERS 8
+#define DAEMOND_LOCK_CONNS   8
+#define DAEMOND_LOCK_WAIT    1.0
+
+static struct {
+	const char      * name;
+	daemond_command   handler;
+} _G_commands[DAEMOND_COMMANDS_MAX];
+static int _G_commands_count = 0;
+
+// connections of stop requests, closed by master's exit
+static int * _G_stop_waiters = NULL;
+static int _G_stop_waiters_count = 0;
+static int _G_stop_waiters_size = 0;
+
+// clients accepted before their command came, polled by master's loop
+static struct {
+	int               fd;
+	double            since;
+} _G_lock_conns[DAEMOND_LOCK_CONNS];
+static int _G_lock_conns_count = 0;
+
+int daemond_control_register(const char * name, daemond_command handler) {
+	int i;
+	for (i=0; i < _G_commands_count; i++) {
+		if (strcmp(_G_commands[i].name, name) == 0) {
+			_G_commands[i].handler = handler;
+			return 0;
+		}
+	}
+	if (_G_commands_count == DAEMOND_COMMANDS_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+	_G_commands[_G_commands_count].name = name;
+	_G_commands[_G_commands_count++].handler = handler;
+	return 0;
+}
+
+static const char * daemond_state_name(int state) {
+	switch (state) {
+		case DAEMOND_STATE_RUNNING:  return "running";
+		case DAEMOND_STATE_EXITED:   return "exited";
+		case DAEMOND_STATE_STOPPING: return "stopping";
+		case DAEMOND_STATE_STOPPED:  return "stopped";
+		default:                     return "none";
+	}
+}
+
+static int daemond_control_status(daemond * d, const char * args, char * reply, size_t size) {
+	size_t len;
+	int i;
+	len = snprintf(reply, size, "pid %d workers %d of %d%s\n", getpid(), d->children_running, d->children_count,
+		d->terminate ? " stopping" : d->draining ? " draining" : "");
+	for (i=0; i < d->children_max && len < size; i++) {
+		if (daemond_slot_pid(d, i) && d->health)
+			len += snprintf(reply + len, size - len, "slot %d pid %d threads %d of %d, %u restarts\n", i, d->children[i],
+				d->slots[i].threads_running, d->threads_per_child, d->slots[i].thread_restarts);
+		else if (daemond_slot_pid(d, i))
+			len += snprintf(reply + len, size - len, "slot %d pid %d %s\n", i, daemond_slot_pid(d, i),
+				d->status ? daemond_state_name(d->status->slot[i].state) : "running");
+		else if (i < d->children_count)
+			len += snprintf(reply + len, size - len, "slot %d restarting\n", i);
+	}
+	return 0;
+}
+
+static int daemond_control_scale(daemond * d, const char * args, char * reply, size_t size) {
+	char * end;
+	long n = strtol(args, &end, 10);
+	int i;
+	if (end == args || n < 0 || n > d->children_max) {
+		snprintf(reply, size, "workers count must be 0..%d\n", d->children_max);
+		return -1;
+	}
+	for (i = n; i < d->children_count; i++) {
+		if (daemond_slot_stop(d, i) == -1)
+			debug("stop of slot %d failed: %s", i, ERR);
+	}
+	snprintf(reply, size, "workers %d -> %ld\n", d->children_count, n);
+	d->children_count = n;
+	return 0;
+}
+
+static int daemond_control_reload(daemond * d, const char * args, char * reply, size_t size) {
+	int i, n = 0;
+	// terminated workers are respawned, exit by TERM doesn't count as death
+	for (i=0; i < d->children_count; i++) {
+		if (daemond_slot_stop(d, i) == 1)
+			n++;
+	}
+	snprintf(reply, size, "replacing %d workers\n", n);
+	return 0;
+}
+
+static int daemond_control_drain(daemond * d, const char * args, char * reply, size_t size) {
+	d->draining = 1;
+	snprintf(reply, size, "draining %d workers\n", d->children_running);
+	return 0;
+}
+
+static int daemond_control_exec(daemond * d, char * line, char * reply, size_t size, int * keep) {
+	char * args;
+	int i;
+
+	line[strcspn(line, "\r\n")] = 0;
+	args = line + strcspn(line, " \t");
+	if (*args)
+		*args++ = 0;
+	args += strspn(args, " \t");
+
+	if (strcmp(line, "pid") == 0) {
+		snprintf(reply, size, "%d\n", getpid());
+		return 0;
+	}
+	if (strcmp(line, "stop") == 0) {
+		// the connection is held until exit, eof is what the client waits for
+		if (_G_stop_waiters_count == _G_stop_waiters_size) {
+			int * w = realloc(_G_stop_waiters, ( _G_stop_waiters_size + DAEMOND_STOP_WAITERS ) * sizeof(int));
+			if (!w) {
+				snprintf(reply, size, "no room to wait for exit\n");
+				return -1;
+			}
+			_G_stop_waiters = w;
+			_G_stop_waiters_size += DAEMOND_STOP_WAITERS;
+		}
+		snprintf(reply, size, "%d\n", getpid());
+		debug("Stop requested over instance socket");
+		d->terminate = 1;
+		*keep = 1;
+		return 0;
+	}
+	for (i=0; i < _G_commands_count; i++) {
+		if (strcmp(_G_commands[i].name, line) == 0)
+			return _G_commands[i].handler(d, args, reply, size);
+	}
+	if (strcmp(line, "status") == 0)
+		return daemond_control_status(d, args, reply, size);
+	if (strcmp(line, "scale") == 0)
+		return daemond_control_scale(d, args, reply, size);
+	if (strcmp(line, "reload") == 0)
+		return daemond_control_reload(d, args, reply, size);
+	if (strcmp(line, "drain") == 0)
+		return daemond_control_drain(d, args, reply, size);
+	if (strcmp(line, "metrics") == 0)
+		return daemond_metrics_format(d, reply, size) == -1 ? -1 : 0;
+	snprintf(reply, size, "unknown command `%s'\n", line);
+	return -1;
+}
+
+/*
+ * Clients are accepted non-blocking and answered from master's loop; one
+ * whose command isn't there yet waits in _G_lock_conns for DAEMOND_LOCK_WAIT
+ * seconds at most. Returns 0 if the command didn't come yet
+ */
+static int daemond_lock_reply(daemond * d, int fd) {
+	char buf[1024], out[16384], reply[16400];
+	ssize_t r;
+	int keep = 0, len;
+
+	while ((r = read(fd, buf, sizeof(buf) - 1)) == -1 && errno == EINTR);
+	if (r == -1 && errno == EAGAIN)
+		return 0;
+	if (r > 0) {
+		buf[r] = 0;
+		*out = 0;
+		len = snprintf(reply, sizeof(reply), "%s %s",
+			daemond_control_exec(d, buf, out, sizeof(out), &keep) == -1 ? "error" : "ok", out);
+		// client may be gone or not reading, that must not stall master
+		if ((r = send(fd, reply, len, MSG_NOSIGNAL|MSG_DONTWAIT)) == -1)
+			debug("Reply over instance socket failed: %s", ERR);
+		else if (r < len)
+			debug("Reply over instance socket cut to %zd of %d bytes", r, len);
+	}
+	// room for a stop waiter is made before the stop is accepted
+	if (keep)
+		_G_stop_waiters[_G_stop_waiters_count++] = fd;
+	else
+		close(fd);
+	return 1;
+}
+
+// called when the listening socket is readable
+static void daemond_lock_serve(daemond * d) {
+	int fd;
+
+	while ((fd = accept4(d->lock_fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) > -1) {
+		if (daemond_lock_reply(d, fd))
+			continue;
+		if (_G_lock_conns_count == DAEMOND_LOCK_CONNS) {
+			debug("Too many instance socket clients waiting, closing %d", fd);
+			close(fd);
+			continue;
+		}
+		_G_lock_conns[_G_lock_conns_count].fd = fd;
+		_G_lock_conns[_G_lock_conns_count++].since = htime();
+	}
+}
+
+// answers the waiting client fd once readable, drops those out of time
+static void daemond_lock_pending(daemond * d, int fd) {
+	double now = htime();
+	int i = 0, done;
+
+	while (i < _G_lock_conns_count) {
+		if (_G_lock_conns[i].fd == fd)
+			done = daemond_lock_reply(d, fd);
+		else if (( done = now - _G_lock_conns[i].since >= DAEMOND_LOCK_WAIT ))
+			close(_G_lock_conns[i].fd);
+		if (done)
+			_G_lock_conns[i] = _G_lock_conns[--_G_lock_conns_count];
+		else
+			i++;
+	}
+}
+
+// in a forked child: the socket and its clients belong to master
+static void daemond_lock_close(daemond * d) {
+	while (_G_lock_conns_count > 0)
+		close(_G_lock_conns[--_G_lock_conns_count].fd);
+	while (_G_stop_waiters_count > 0)
+		close(_G_stop_waiters[--_G_stop_waiters_count]);
+	if (d->lock_fd > -1) {
+		close(d->lock_fd);
+		d->lock_fd = -1;
+	}
+}
+
+#else
+
+int daemond_lock_socket(daemond * d) {
+	die("Instance socket needs abstract unix sockets (linux)");
+	return 0;
+}
+
+static int daemond_control_send(daemond * d, const char * cmd) {
+	return -1;
+}
+
+static int daemond_control_query(daemond * d, const char * cmd, char * buf, size_t size, double timeout, int * eof) {
+	*eof = 0;
+	return -1;
+}
+
+int daemond_control_call(daemond * d, const char * command, char * reply, size_t size) {
+	return -1;
+}
+
+int daemond_control_register(const char * name, daemond_command handler) {
+	return 0;
+}
+
+pid_t daemond_lock_pid(daemond * d) {
+	return 0;
+}
+
+static void daemond_lock_serve(daemond * d) {
+}
+
+static void daemond_lock_pending(daemond * d, int fd) {
+}
+
+static void daemond_lock_close(daemond * d) {
+}
+
+#endif
+
+/*
+ * Cli functions
+ */
+
+// monotonic: intervals and deadlines must not jump with the wall clock
+static double htime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_nsec / 1000000000) + ((double)ts.tv_sec);
+}
+
+
+static int kill_ext(int pidgrp, int sig) {
+	pid_t pid;
+	pid_t grp;
+	if (pidgrp < 0) {
+		pid = -pidgrp;
+		grp = getpgid(pid);
+		if (grp == -1) {
+			return -1; // also have good errno
+		}
+		if (grp == getpgrp()) {
+			// not detached master shares our group, don't kill ourselves
+			return kill(pid,sig);
+		}
+		debug("detected grp %d for pid %d",grp,pid);
+		return killpg(grp,sig);
+	} else {
+		pid = pidgrp;
+		return kill(pid,sig);
+	}
+}
+
+/*
+ * Process exit is waited for on a pidfd, which becomes readable the moment
+ * the process is gone and can't be confused with a reused pid. Without
+ * pidfd support the pid is probed with growing pauses up to 50ms
+ */
+static int daemond_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int daemond_pidfd_kill(int pidfd, pid_t inpid, int sig) {
+#ifdef SYS_pidfd_send_signal
+	if (pidfd > -1 && inpid > 0)
+		return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#endif
+	return kill_ext(inpid, sig);
+}
+
+// 1 if process is gone within interval, 0 if not, -1 on error
+static int daemond_kill_wait( pid_t inpid, int pidfd, int sig, double interval ) {
+	double at = htime(), left;
+	pid_t pid = (inpid < 0) ? -inpid : inpid;
+	struct pollfd pfd = { pidfd, POLLIN, 0 };
+	useconds_t pause = 1000;
+	int r;
+
+	if( daemond_pidfd_kill(pidfd, inpid, sig) == -1 ) {
+		switch(errno) {
+			case ESRCH:
+				return 1;
+			default:
+				ewarn("kill %d",pid);
+				return -1;
+		}
+	}
+	while (1) {
+		left = interval - ( htime() - at );
+		if (pidfd > -1) {
+			r = poll(&pfd, 1, left > 0 ? (int)(left * 1000) + 1 : 0);
+			if (r > 0)
+				return 1;
+			if (r == -1 && errno != EINTR) {
+				ewarn("poll on pidfd of %d", pid);
+				return -1;
+			}
+		}
+		else {
+			if(kill(pid,0) == -1)
+				return errno == ESRCH ? 1 : -1;
+			if (left > 0) {
+				usleep(pause);
+				if (pause < 50000) pause *= 2;
+			}
+		}
+		if (htime() - at >= interval)
+			return 0;
+	}
+}
+
+pid_t daemond_cli_kill(daemond_cli * cli, pid_t pid) {
+	daemond * d = cli->d;
+	double at = htime();
+	int pidfd;
+
+	if (kill(pid,0) == 0) {
+		pidfd = daemond_pidfd_open(pid);
+		daemond_say(d,"<y>killing %d with <b><w>INT</>", pid);
+		if ( daemond_kill_wait(pid, pidfd, SIGINT, d->stop_int ) ) {
+			//debug("Gone after SIGINT");
+		} else {
+			daemond_say(d,"<y>killing %d with <b><w>TERM</>", pid);
+			if( daemond_kill_wait(pid, pidfd, SIGTERM, d->stop_term ) ) {
+				//debug("Gone after SIGTERM");
+			} else {
+				daemond_say(d,"<y>killing %d group with <r><b>KILL</>", pid);
+				if( daemond_kill_wait(-pid, pidfd, SIGKILL, d->stop_kill ) ) {
+					//debug("Gone after SIGKILL");
+				} else {
+					warn("WTF? Not gone after KILL!");
+					daemond_say(d,"<r>Process not gone after KILL. Giving up");
+					if (pidfd > -1) close(pidfd);
+					return 0;
+				}
+			}
+		}
+		if (pidfd > -1) close(pidfd);
+		daemond_say(d,"<g>process %d is gone</> in %.3fs", pid, htime() - at);
+
+	} else {
+		return errno == ESRCH ? pid : 0;
+	}
+	return pid;
+}
+
+void daemond_cli_usage(daemond_cli * cli) {
+
+}
+
+// check by status file, exits if it tells anything certain
+static void daemond_cli_status(daemond_cli * cli, pid_t pid) {
+	daemond * d = cli->d;
+	char buf[ sizeof(daemond_status) + 64 * sizeof(daemond_status_slot) ];
+	daemond_status * st = (daemond_status *)buf;
+	int slots, i;
+
+	if ((slots = daemond_status_load(d->status_file, st, sizeof(buf))) == -1) {
+		debug("Can't load status file `%s': %s", d->status_file, ERR);
+		return;
+	}
+	if (st->pid != pid)
+		return;
+	if (!daemond_status_alive(st)) {
+		daemond_say(d, "<g>not running</> - pid <r>%d</> %s", pid,
+			st->state == DAEMOND_STATE_STOPPED ? "stopped" : "reused or gone");
+		exit(255);
+	}
+	daemond_say(d, "<g>%s</> - pid <r>%d</>, up %llds, %d of %u workers, generation %llu",
+		st->state == DAEMOND_STATE_STOPPING ? "stopping" : "running", pid,
+		(long long)(time(NULL) - st->started), st->running, st->slots, (unsigned long long)st->generation);
+	for (i=0; i < slots && (char *)&st->slot[i + 1] <= buf + sizeof(buf); i++) {
+		if (st->slot[i].state == DAEMOND_STATE_RUNNING && st->slot[i].threads)
+			daemond_say(d, "  slot %d - pid <r>%lld</>, forked %llu times, %d of %d threads, %llu restarts", i,
+				(long long)st->slot[i].pid, (unsigned long long)st->slot[i].forks, st->slot[i].threads_running,
+				st->slot[i].threads, (unsigned long long)st->slot[i].thread_restarts);
+		else if (st->slot[i].state == DAEMOND_STATE_RUNNING)
+			daemond_say(d, "  slot %d - pid <r>%lld</>, forked %llu times", i,
+				(long long)st->slot[i].pid, (unsigned long long)st->slot[i].forks);
+		else if (st->slot[i].state == DAEMOND_STATE_EXITED)
+			daemond_say(d, "  slot %d - <y>restarting</>, forked %llu times", i,
+				(unsigned long long)st->slot[i].forks);
+	}
+	exit(0);
+}
+
+/*
+ * Asks master to stop over the instance socket and waits for its exit,
+ * which closes the connection. Falls back to signals if master neither
+ * answers nor exits in time. Returns pid of the gone master or 0
+ */
+static pid_t daemond_cli_stop(daemond_cli * cli, pid_t pid) {
+	daemond * d = cli->d;
+	char buf[32];
+	int eof;
+
+	if (daemond_control_query(d, "stop\n", buf, sizeof(buf), 10, &eof) > 0 && strncmp(buf, "ok ", 3) == 0) {
+		pid = atoi(buf + 3);
+		daemond_say(d, "<y>asked %d to stop</>", pid);
+		// eof is master's exit only if the pid goes away as well
+		if (eof) {
+			int pidfd = daemond_pidfd_open(pid);
+			int gone = daemond_kill_wait(pid, pidfd, 0, 1) == 1;
+			if (pidfd > -1) close(pidfd);
+			if (gone) {
+				daemond_say(d, "<g>process %d is gone</>", pid);
+				return pid;
+			}
+		}
+	}
+	return pid ? daemond_cli_kill(cli, pid) : 0;
+}
+
+// passes a not builtin CLI command to master, prints its answer and exits
+static void daemond_cli_forward(daemond_cli * cli, int argc, char *argv[]) {
+	char line[1024], reply[16400], *p;
+	size_t len = 0;
+	int i, eof;
+
+	for (i=0; i < argc && len < sizeof(line) - 2; i++)
+		len += snprintf(line + len, sizeof(line) - 1 - len, "%s%s", i ? " " : "", argv[i]);
+	strcpy(line + ( len < sizeof(line) - 2 ? len : sizeof(line) - 2 ), "\n");
+	if (daemond_control_query(cli->d, line, reply, sizeof(reply), 5, &eof) == -1) {
+		daemond_say(cli->d, "<r>master doesn't answer</>");
+		exit(255);
+	}
+	for (p = strtok(reply, "\n"); p; p = strtok(NULL, "\n"))
+		daemond_say(cli->d, "%s", p);
+	exit(strncmp(reply, "ok", 2) == 0 ? 0 : 255);
+}
+
+// check/start/stop/restart against the instance socket instead of pidfile
+static void daemond_cli_socket(daemond_cli * cli, daemond_cli_com com, int argc, char *argv[]) {
+	daemond * d = cli->d;
+	pid_t oldpid;
+	double t;
+
+	if (daemond_lock_socket(d)) {
+		if ( com == STOP || com == CHECK || com == EXTENDED ) {
+			daemond_say(d, "<y><b>no instance running</>");
+			exit(com == EXTENDED ? 255 : 0);
+		}
+		return;
+	}
+
+	switch(com) {
+		case CHECK:
+			oldpid = daemond_lock_pid(d);
+			if (oldpid && d->status_file) {
+				daemond_cli_status(cli, oldpid);
+			}
+			if (oldpid) {
+				daemond_say(d, "<g>running</> - pid <r>%d</>", oldpid);
+				exit(0);
+			}
+			daemond_say(d, "<r>instance socket is held, but master doesn't answer</>");
+			exit(255);
+		case START:
+			daemond_say(d, "is <b><red>already running</> (pid <red>%d</>)", daemond_lock_pid(d));
+			exit(255);
+		case STOP:
+		case RESTART:
+			if (!daemond_cli_stop(cli, 0)) {
+				daemond_say(d, "<r>instance socket is held, but master doesn't stop</>");
+				exit(255);
+			}
+			// the name is released with the last descriptor, a moment after exit
+			t = htime();
+			while (!daemond_lock_socket(d)) {
+				if (htime() - t > 5) {
+					daemond_say(d, "<r>instance socket is still held</>");
+					exit(255);
+				}
+				usleep(10000);
+			}
+			if (com == STOP)
+				exit(0);
+			break;
+		default:
+			daemond_cli_forward(cli, argc, argv);
+	}
+}
+
+void daemond_cli_run(daemond_cli * cli, int argc, char *argv[]) {
+	//debug("name = %s",cli->d->name);
+	if (!cli->d->use_pid && !cli->d->use_socket) {
+		daemond_say(cli->d,"<r>use_pid or use_socket required for CLI");
+		exit(255);
+	}
+	daemond_pid * pid = &cli->d->pid;
+	pid_t oldpid, killed = 0;
+	char * command;
+	daemond_cli_com com;
+
+	//daemond_cli_kill(cli,96202);exit(0);
+
+	if (argc > 0) {
+		command = argv[0];
+		//debug("got command '%s'",command);
+	} else {
+		daemond_say(cli->d, "<r>Need command");
+		exit(255);
+	}
+
+
+	if ( strcmp(command, "start") == 0 ) {
+		com = START;
+	} else
+	if ( strcmp(command, "stop") == 0 ) {
+		com = STOP;
+	} else
+	if ( strcmp(command, "restart") == 0 ) {
+		com = RESTART;
+	} else
+	if ( strcmp(command, "check") == 0 ) {
+		com = CHECK;
+	} else
+		com = EXTENDED;
+
+	if (cli->d->use_socket) {
+		daemond_cli_socket(cli, com, argc, argv);
+		if ( com != START && com != RESTART) {
+			daemond_say(cli->d, "<b><y>unknown command: <r>%s</>", command);
+			daemond_cli_usage( cli );
+			exit(0);
+		}
+		return;
+	}
+
+	if( daemond_pid_lock(pid) ) {
+		//debug("pid locked by cli");
+	} else {
+		//debug("pid not locked (old=%d)", pid->oldpid);
+		if ((oldpid = pid->oldpid)) {
+			//debug("have old pid: %d",pid->oldpid);
+			switch(com) {
+				case STOP:
+				case RESTART:
+					killed = cli->d->control ? daemond_cli_stop(cli,oldpid) : daemond_cli_kill(cli,oldpid);
+					if (com == STOP)
+						exit(255);
+					daemond_pid_lock(pid);
+					break;
+				case CHECK:
+					if (cli->d->status_file) {
+						daemond_cli_status(cli, oldpid);
+					}
+					if (kill(oldpid,0) == 0) {
+						daemond_say(cli->d, "<g>running</> - pid <r>%d</>", oldpid);
+						exit(0);
+					} else {
+						daemond_say(cli->d, "<g>not running</> - stalled pidfile <r>%d</>", oldpid);
+						exit(255);
+					}
+					break;
+				case START:
+					daemond_say(cli->d, "is <b><red>already running</> (pid <red>%d</>)",oldpid);
+					exit(255);
+				default:
+					if (cli->d->control)
+						daemond_cli_forward(cli, argc, argv);
+					break;
+			}
+		} else {
+			daemond_say(cli->d, "<r>pid neither locked nor have old value</>");
+			exit(255);
+		}
+	}
+
+	if ( ( com == STOP || com == CHECK ) || ( com == RESTART && !killed ) )
+		daemond_say(cli->d, "<y><b>no instance running</>");
+
+	if ( com == STOP || com == CHECK )
+		exit(0);
+
+	if ( com != START && com != RESTART) {
+		daemond_say(cli->d, "<b><y>unknown command: <r>%s</>", command);
+		daemond_cli_usage( cli );
+		exit(0);
+	}
+
+}
+
+/*
+ * Fleet
+ *
+ * Runs a CLI command over many instances from a single poll loop. Stop
+ * ladders of all of them proceed side by side on pidfds, start commands
+ * run as child shells, at most concurrency items are in progress at once
+ */
+
+enum {
+	DAEMOND_FLEET_PENDING,
+	DAEMOND_FLEET_STOPPING,
+	DAEMOND_FLEET_STARTING,
+	DAEMOND_FLEET_DONE,
+};
+
+typedef struct {
+	int               state;
+	int               stage;     // of the stop ladder: stop request or INT, TERM, KILL; 3 - gone, restart waits for reap
+	int               fd;        // pidfd of instance or start shell, -1 - probe
+	int               sock;      // instance socket a stop was asked over
+	pid_t             pid;
+	double            at;
+	double            deadline;  // of the current stage, 0 - none
+} daemond_fleet_run;
+
+// instance pid by pidfile or socket, 0 if there is none
+static pid_t daemond_fleet_pid(daemond * d, daemond_fleet_item * it) {
+	daemond t;
+	pid_t pid;
+	int fd;
+
+	if (*it->target == '@') {
+		t = *d;
+		t.name = it->target + 1;
+		return daemond_lock_pid(&t);
+	}
+	if ((fd = open(it->target, O_RDONLY|O_CLOEXEC)) == -1)
+		return 0;
+	pid = daemond_pid_pread(fd);
+	close(fd);
+	if (pid <= 0 || ( kill(pid, 0) == -1 && errno == ESRCH ))
+		return 0;
+	return pid;
+}
+
+static void daemond_fleet_done(daemond * d, daemond_fleet_item * it, daemond_fleet_run * r, int result, const char * fmt, ...) {
+	va_list va_args;
+	va_start(va_args, fmt);
+	vsnprintf(it->message, sizeof(it->message), fmt, va_args);
+	va_end(va_args);
+	if (r->fd > -1) close(r->fd);
+	if (r->sock > -1) close(r->sock);
+	r->fd = r->sock = -1;
+	r->state   = DAEMOND_FLEET_DONE;
+	it->result = result;
+	it->took   = htime() - r->at;
+	if (result)
+		daemond_say(d, "<r>failed</> %s - %s", it->target, it->message);
+	else
+		daemond_say(d, "<g>ok</> %s - %s", it->target, it->message);
+}
+
+static void daemond_fleet_start(daemond * d, daemond_fleet_item * it, daemond_fleet_run * r) {
+	pid_t pid;
+	if (!it->start) {
+		daemond_fleet_done(d, it, r, -1, "no start command");
+		return;
+	}
+	switch (pid = fork()) {
+		case -1:
+			daemond_fleet_done(d, it, r, -1, "fork failed: %s", ERR);
+			return;
+		case 0:
+			execl("/bin/sh", "sh", "-c", it->start, (char *)NULL);
+			_exit(127);
+	}
+	r->state    = DAEMOND_FLEET_STARTING;
+	r->pid      = pid;
+	r->fd       = daemond_pidfd_open(pid);
+	r->deadline = 0;
+}
+
+static void daemond_fleet_stage(daemond * d, daemond_fleet_item * it, daemond_fleet_run * r) {
+	static const int sig[] = { SIGINT, SIGTERM, SIGKILL };
+	double wait[] = { d->stop_int, d->stop_term, d->stop_kill };
+	daemond t;
+
+	if (r->stage == 0 && *it->target == '@') {
+		t = *d;
+		t.name = it->target + 1;
+		// the answer is not waited for, exit is seen on pidfd
+		r->sock = daemond_control_send(&t, "stop\n");
+	}
+	// stop request over the socket takes place of INT only, TERM and KILL follow it
+	if (( r->stage > 0 || r->sock == -1 ) && daemond_pidfd_kill(r->fd, r->stage == 2 ? -r->pid : r->pid, sig[r->stage]) == -1 && errno != ESRCH)
+		debug("kill %d failed: %s", r->pid, ERR);
+	r->deadline = htime() + wait[r->stage];
+}
+
+static void daemond_fleet_begin(daemond * d, const char * command, daemond_fleet_item * it, daemond_fleet_run * r) {
+	r->at = htime();
+	r->fd = r->sock = -1;
+	it->pid = r->pid = daemond_fleet_pid(d, it);
+
+	if (strcmp(command, "check") == 0) {
+		if (r->pid)
+			daemond_fleet_done(d, it, r, 0, "running, pid %d", r->pid);
+		else
+			daemond_fleet_done(d, it, r, -1, "not running");
+	}
+	else if (strcmp(command, "start") == 0) {
+		if (r->pid)
+			daemond_fleet_done(d, it, r, -1, "already running, pid %d", r->pid);
+		else
+			daemond_fleet_start(d, it, r);
+	}
+	else if (!r->pid) {
+		if (strcmp(command, "restart") == 0)
+			daemond_fleet_start(d, it, r);
+		else
+			daemond_fleet_done(d, it, r, 0, "not running");
+	}
+	else {
+		r->state = DAEMOND_FLEET_STOPPING;
+		r->stage = 0;
+		r->fd    = daemond_pidfd_open(r->pid);
+		daemond_fleet_stage(d, it, r);
+	}
+}
+
+// the process waited for is gone
+static void daemond_fleet_exited(daemond * d, const char * command, daemond_fleet_item * it, daemond_fleet_run * r) {
+	int status;
+	if (r->state == DAEMOND_FLEET_STARTING) {
+		while (waitpid(r->pid, &status, 0) == -1 && errno == EINTR);
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			daemond_fleet_done(d, it, r, 0, "started in %.3fs", htime() - r->at);
+		else
+			daemond_fleet_done(d, it, r, -1, "start command failed with status %d", status);
+		it->pid = daemond_fleet_pid(d, it);
+	}
+	else if (strcmp(command, "restart") == 0) {
+		if (r->fd > -1) close(r->fd);
+		r->fd = -1;
+		// exit is seen, the pid may be reused meanwhile: no more signals, and
+		// a pid still alive after stop_kill is a new process, start anyway
+		r->stage    = 3;
+		r->deadline = htime() + d->stop_kill;
+		// exited but not reaped yet, pidfile lock would still see it alive
+		if (kill(r->pid, 0) == -1 && errno == ESRCH)
+			daemond_fleet_start(d, it, r);
+	}
+	else {
+		daemond_fleet_done(d, it, r, 0, "stopped in %.3fs", htime() - r->at);
+	}
+}
+
+static int daemond_fleet_gone(daemond_fleet_run * r) {
+	siginfo_t info;
+	if (r->state == DAEMOND_FLEET_STARTING) {
+		info.si_pid = 0;
+		return waitid(P_PID, r->pid, &info, WEXITED|WNOHANG|WNOWAIT) == 0 && info.si_pid;
+	}
+	return kill(r->pid, 0) == -1 && errno == ESRCH;
+}
+
+int daemond_fleet(daemond * d, const char * command, daemond_fleet_item * items, int count, int concurrency) {
+	daemond_fleet_run * r;
+	struct pollfd * fds;
+	int * idx;
+	int i, n, next = 0, active = 0, failed = 0, timeout;
+	double now, soonest;
+
+	if (strcmp(command, "check") && strcmp(command, "start") && strcmp(command, "stop") && strcmp(command, "restart")) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (concurrency < 1)
+		concurrency = count;
+	r   = calloc(count, sizeof(*r));
+	fds = calloc(count, sizeof(*fds));
+	idx = calloc(count, sizeof(*idx));
+	if (!r || !fds || !idx)
+		die("Can't allocate fleet of %d: %s", count, ERR);
+
+	while (next < count || active) {
+		while (active < concurrency && next < count) {
+			daemond_fleet_begin(d, command, &items[next], &r[next]);
+			if (r[next].state != DAEMOND_FLEET_DONE)
+				active++;
+			next++;
+		}
+		if (!active)
+			continue;
+
+		n = 0; timeout = -1; now = htime(); soonest = 0;
+		for (i=0; i < next; i++) {
+			if (r[i].state == DAEMOND_FLEET_DONE)
+				continue;
+			if (r[i].fd > -1) {
+				fds[n].fd = r[i].fd; fds[n].events = POLLIN; fds[n].revents = 0;
+				idx[n++] = i;
+			}
+			else {
+				timeout = 50; // nothing to poll, probe
+			}
+			if (r[i].deadline && ( !soonest || r[i].deadline < soonest ))
+				soonest = r[i].deadline;
+		}
+		if (soonest) {
+			int until = soonest > now ? (int)(( soonest - now ) * 1000) + 1 : 0;
+			if (timeout == -1 || until < timeout)
+				timeout = until;
+		}
+		if (poll(fds, n, timeout) == -1 && errno != EINTR)
+			die("poll failed: %s", ERR);
+
+		for (i=0; i < n; i++) {
+			if (fds[i].revents && r[idx[i]].fd == fds[i].fd)
+				daemond_fleet_exited(d, command, &items[idx[i]], &r[idx[i]]);
+		}
+		now = htime();
+		for (i=0; i < next; i++) {
+			if (r[i].state == DAEMOND_FLEET_DONE || r[i].state == DAEMOND_FLEET_PENDING)
+				continue;
+			if (r[i].fd == -1 && daemond_fleet_gone(&r[i]))
+				daemond_fleet_exited(d, command, &items[i], &r[i]);
+			else if (r[i].deadline && now >= r[i].deadline) {
+				if (r[i].stage == 3)
+					daemond_fleet_start(d, &items[i], &r[i]);
+				else if (r[i].stage == 2)
+					daemond_fleet_done(d, &items[i], &r[i], -1, "not gone after KILL");
+				else {
+					r[i].stage++;
+					daemond_fleet_stage(d, &items[i], &r[i]);
+				}
+			}
+		}
+		for (i=0, active=0; i < next; i++) {
+			if (r[i].state != DAEMOND_FLEET_DONE)
+				active++;
+		}
+	}
+
+	for (i=0; i < count; i++) {
+		if (items[i].result)
+			failed++;
+	}
+	free(r);
+	free(fds);
+	free(idx);
+	return failed;
+}
+
+/*
+ * Log file
+ *
+ * Lines are collected in a userspace buffer and written with O_APPEND when
+ * it fills up or the oldest line is older than flush_interval. SIGUSR1
+ * reopens the file (for logrotate), data is synced every fsync_interval
+ */
+
+static struct {
+	char                  * path;
+	int                     fd;
+	char                  * buf;
+	size_t                  size;
+	size_t                  len;
+	double                  flush_interval;
+	double                  fsync_interval;
+	double                  first_at;  // when the oldest buffered byte came
+	double                  synced_at;
+	int                     bol;       // next write starts a line
+	time_t                  stamp_at;
+	char                    stamp[32];
+	volatile sig_atomic_t   reopen;
+	pthread_mutex_t         lock;
+} _G_logfile = {
+	.fd   = -1,
+	.bol  = 1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void daemond_log_file_write(const char * buf, size_t len) {
+	ssize_t w;
+	while (len > 0) {
+		if ((w = write(_G_logfile.fd, buf, len)) == -1) {
+			if (errno == EINTR) continue;
+			return; // nowhere to complain, tracer is us
+		}
+		buf += w;
+		len -= w;
+	}
+}
+
+static void daemond_log_file_flush_locked(void) {
+	double now;
+	if (_G_logfile.len) {
+		daemond_log_file_write(_G_logfile.buf, _G_logfile.len);
+		_G_logfile.len = 0;
+	}
+	if (_G_logfile.fsync_interval > 0) {
+		now = htime();
+		if (now - _G_logfile.synced_at >= _G_logfile.fsync_interval) {
+			fdatasync(_G_logfile.fd);
+			_G_logfile.synced_at = now;
+		}
+	}
+}
+
+/*
+ * The lock is held across fork, so no other thread is halfway through the
+ * buffer when it is copied. Child must not inherit and write out the same
+ * lines again, so they are flushed first
+ */
+static void daemond_log_file_atfork_prepare(void) {
+	pthread_mutex_lock(&_G_logfile.lock);
+	if (_G_logfile.fd > -1)
+		daemond_log_file_flush_locked();
+}
+
+static void daemond_log_file_atfork_release(void) {
+	pthread_mutex_unlock(&_G_logfile.lock);
+}
+
+static void daemond_log_file_atexit(void) {
+	if (_G_logfile.fd > -1)
+		daemond_log_file_flush();
+}
+
+int daemond_log_file_open(const char * path, size_t buffer, double flush_interval, double fsync_interval) {
+	static int registered = 0;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP)) == -1)
+		return -1;
+	daemond_log_file_close();
+
+	pthread_mutex_lock(&_G_logfile.lock);
+	_G_logfile.fd   = fd;
+	_G_logfile.path = strdup(path);
+	_G_logfile.size = buffer;
+	_G_logfile.len  = 0;
+	_G_logfile.buf  = buffer ? malloc(buffer) : NULL;
+	if (buffer && !_G_logfile.buf)
+		_G_logfile.size = 0;
+	_G_logfile.flush_interval = flush_interval;
+	_G_logfile.fsync_interval = fsync_interval;
+	_G_logfile.synced_at = htime();
+	_G_logfile.bol = 1;
+	pthread_mutex_unlock(&_G_logfile.lock);
+
+	if (!registered) {
+		pthread_atfork(daemond_log_file_atfork_prepare, daemond_log_file_atfork_release, daemond_log_file_atfork_release);
+		atexit(daemond_log_file_atexit);
+		registered = 1;
+	}
+	return 0;
+}
+
+int daemond_log_file_reopen(void) {
+	int fd, r = 0;
+	pthread_mutex_lock(&_G_logfile.lock);
+	_G_logfile.reopen = 0;
+	if (_G_logfile.fd > -1) {
+		daemond_log_file_flush_locked();
+		if ((fd = open(_G_logfile.path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP)) == -1) {
+			r = -1; // keep writing into the old one
+		} else {
+			close(_G_logfile.fd);
+			_G_logfile.fd = fd;
+		}
+	}
+	pthread_mutex_unlock(&_G_logfile.lock);
+	return r;
+}
+
+void daemond_log_file_flush(void) {
+	pthread_mutex_lock(&_G_logfile.lock);
+	if (_G_logfile.fd > -1)
+		daemond_log_file_flush_locked();
+	pthread_mutex_unlock(&_G_logfile.lock);
+}
+
+// flushes lines waiting longer than flush_interval, called from master loop
+static void daemond_log_file_tick(void) {
+	if (_G_logfile.fd > -1 && _G_logfile.len && htime() - _G_logfile.first_at >= _G_logfile.flush_interval)
+		daemond_log_file_flush();
+}
+
+/*
+ * Seconds until the tick has to run, -1 - never. With shared set other
+ * threads may buffer a line while master sleeps, so master looks again
+ * within flush_interval even with nothing buffered
+ */
+static double daemond_log_file_due(int shared) {
+	double left;
+	if (_G_logfile.fd == -1 || !_G_logfile.size)
+		return -1;
+	if (!_G_logfile.len)
+		return shared ? _G_logfile.flush_interval : -1;
+	left = _G_logfile.first_at + _G_logfile.flush_interval - htime();
+	return left > 0 ? left : 0;
+}
+
+/*
+ * A worker has no loop to run the tick, a buffered line of it would wait
+ * for the next one, so workers write out each record unless told otherwise.
+ * The buffer stays, a record still goes with one write
+ */
+static void daemond_log_file_unbuffer(void) {
+	pthread_mutex_lock(&_G_logfile.lock);
+	if (_G_logfile.fd > -1)
+		daemond_log_file_flush_locked();
+	_G_logfile.flush_interval = 0;
+	pthread_mutex_unlock(&_G_logfile.lock);
+}
+
+void daemond_log_file_close(void) {
+	pthread_mutex_lock(&_G_logfile.lock);
+	if (_G_logfile.fd > -1) {
+		daemond_log_file_flush_locked();
+		close(_G_logfile.fd);
+		_G_logfile.fd = -1;
+	}
+	free(_G_logfile.buf);
+	free(_G_logfile.path);
+	_G_logfile.buf = _G_logfile.path = NULL;
+	_G_logfile.size = _G_logfile.len = 0;
+	pthread_mutex_unlock(&_G_logfile.lock);
+}
+
+void daemond_log_file_tracer(const char * fmt, va_list va_args) {
+	char buf[4096], * big;
+	const char * cfmt;
+	struct tm tm;
+	time_t now;
+	va_list ap;
+	int n;
+
+	if (_G_logfile.fd == -1)
+		return;
+	if (_G_logfile.reopen)
+		daemond_log_file_reopen();
+	cfmt = daemond_color_fmt(fmt, 1, buf, sizeof(buf));
+
+	pthread_mutex_lock(&_G_logfile.lock);
+	if (!_G_logfile.len)
+		_G_logfile.first_at = htime();
+
+	if (_G_logfile.bol) {
+		now = time(NULL);
+		if (now != _G_logfile.stamp_at) {
+			localtime_r(&now, &tm);
+			strftime(_G_logfile.stamp, sizeof(_G_logfile.stamp), "%Y-%m-%d %H:%M:%S", &tm);
+			_G_logfile.stamp_at = now;
+		}
+		if (_G_logfile.size - _G_logfile.len < 64)
+			daemond_log_file_flush_locked();
+		if (_G_logfile.size) {
+			_G_logfile.len += snprintf(_G_logfile.buf + _G_logfile.len, _G_logfile.size - _G_logfile.len, "%s [%d] ", _G_logfile.stamp, getpid());
+		} else {
+			dprintf(_G_logfile.fd, "%s [%d] ", _G_logfile.stamp, getpid());
+		}
+	}
+
+	va_copy(ap, va_args);
+	n = vsnprintf(_G_logfile.buf + _G_logfile.len, _G_logfile.size - _G_logfile.len, cfmt, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t)n >= _G_logfile.size - _G_logfile.len) {
+		// didn't fit, write out what we have and try again
+		daemond_log_file_flush_locked();
+		if ((size_t)n < _G_logfile.size) {
+			n = vsnprintf(_G_logfile.buf, _G_logfile.size, cfmt, va_args);
+		}
+		else if ((big = malloc(n + 1))) {
+			vsnprintf(big, n + 1, cfmt, va_args);
+			daemond_log_file_write(big, n);
+			_G_logfile.bol = n > 0 && big[n - 1] == '\n';
+			free(big);
+			n = 0;
+		}
+		else n = 0;
+	}
+	if (n > 0) {
+		_G_logfile.len += n;
+		_G_logfile.bol = _G_logfile.buf[_G_logfile.len - 1] == '\n';
+	}
+
+	if (_G_logfile.len >= _G_logfile.size || htime() - _G_logfile.first_at >= _G_logfile.flush_interval)
+		daemond_log_file_flush_locked();
+	pthread_mutex_unlock(&_G_logfile.lock);
+}
+
+/*
+ * Syslog/journald sink
+ *
+ * Every line becomes one datagram on a unix socket, either in journald
+ * native format (KEY=value lines) or RFC 5424. Datagrams are batched and
+ * sent with sendmmsg(2) without blocking, what doesn't fit is counted
+ */
+
+#define DAEMOND_SYSLOG_BATCH 16
+#define DAEMOND_SYSLOG_MSG   2048
+#define DAEMOND_SYSLOG_SDID  "daemond@32473"
+
+static struct {
+	daemond               * d;
+	int                     fd;
+	daemond_syslog_format   format;
+	int                     facility;
+	char                    path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	char                    host[64];
+	int                     count;
+	size_t                  len[DAEMOND_SYSLOG_BATCH];
+	char                    msg[DAEMOND_SYSLOG_BATCH][DAEMOND_SYSLOG_MSG];
+	double                  first_at;
+	double                  flush_interval;
+	unsigned long           dropped;
+	pthread_mutex_t         lock;
+} _G_syslog = {
+	.fd   = -1,
+	.flush_interval = 0.1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// lines are assembled per thread, tracers are called with fragments
+static __thread char   _G_syslog_line[DAEMOND_SYSLOG_MSG];
+static __thread size_t _G_syslog_line_len = 0;
+
+static int daemond_syslog_connect(void) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, _G_syslog.path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	if (_G_syslog.fd > -1)
+		close(_G_syslog.fd);
+	_G_syslog.fd = fd;
+	return 0;
+}
+
+static void daemond_syslog_flush_locked(void) {
+	int sent = 0, r, retry = 1;
+#ifdef __linux__
+	struct mmsghdr msgs[DAEMOND_SYSLOG_BATCH];
+	struct iovec iov[DAEMOND_SYSLOG_BATCH];
+	int i;
+
+	bzero(msgs, sizeof(msgs[0]) * _G_syslog.count);
+	for (i=0; i < _G_syslog.count; i++) {
+		iov[i].iov_base = _G_syslog.msg[i];
+		iov[i].iov_len  = _G_syslog.len[i];
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+	while (sent < _G_syslog.count) {
+#ifdef __linux__
+		r = sendmmsg(_G_syslog.fd, msgs + sent, _G_syslog.count - sent, MSG_DONTWAIT);
+#else
+		r = send(_G_syslog.fd, _G_syslog.msg[sent], _G_syslog.len[sent], MSG_DONTWAIT) == -1 ? -1 : 1;
+#endif
+		if (r > 0) {
+			sent += r;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		// listener restarted, its socket is a new one
+		if (retry-- && ( errno == ECONNREFUSED || errno == ENOTCONN ) && daemond_syslog_connect() == 0)
+			continue;
+		break;
+	}
+	_G_syslog.dropped += _G_syslog.count - sent;
+	_G_syslog.count = 0;
+}
+
+static void daemond_syslog_emit(int severity, const char * text, size_t tlen) {
+	daemond * d = _G_syslog.d;
+	const char * name = d && d->name ? d->name : "daemond";
+	int slot = d ? d->slot : -1, n;
+	char * m, stamp[40];
+	struct timeval tv;
+	struct tm tm;
+
+	pthread_mutex_lock(&_G_syslog.lock);
+	if (_G_syslog.fd == -1) {
+		pthread_mutex_unlock(&_G_syslog.lock);
+		return;
+	}
+	if (!_G_syslog.count)
+		_G_syslog.first_at = htime();
+	m = _G_syslog.msg[ _G_syslog.count ];
+
+	if (_G_syslog.format == DAEMOND_SYSLOG_JOURNAL) {
+		n = snprintf(m, DAEMOND_SYSLOG_MSG,
+			"PRIORITY=%d\nSYSLOG_FACILITY=%d\nSYSLOG_IDENTIFIER=%s\nSYSLOG_PID=%d\n",
+			severity, _G_syslog.facility >> 3, name, getpid());
+		if (slot > -1 && n < DAEMOND_SYSLOG_MSG)
+			n += snprintf(m + n, DAEMOND_SYSLOG_MSG - n, "DAEMOND_SLOT=%d\n", slot);
+		if (n < DAEMOND_SYSLOG_MSG)
+			n += snprintf(m + n, DAEMOND_SYSLOG_MSG - n, "MESSAGE=%.*s\n", (int)tlen, text);
+	} else {
+		gettimeofday(&tv, NULL);
+		gmtime_r(&tv.tv_sec, &tm);
+		n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(stamp + n, sizeof(stamp) - n, ".%06ldZ", (long)tv.tv_usec);
+		n = snprintf(m, DAEMOND_SYSLOG_MSG, "<%d>1 %s %s %s %d - ",
+			_G_syslog.facility | severity, stamp, _G_syslog.host, name, getpid());
+		if (n < DAEMOND_SYSLOG_MSG)
+			n += slot > -1
+				? snprintf(m + n, DAEMOND_SYSLOG_MSG - n, "[" DAEMOND_SYSLOG_SDID " slot=\"%d\"] ", slot)
+				: snprintf(m + n, DAEMOND_SYSLOG_MSG - n, "- ");
+		if (n < DAEMOND_SYSLOG_MSG)
+			n += snprintf(m + n, DAEMOND_SYSLOG_MSG - n, "%.*s", (int)tlen, text);
+	}
+	_G_syslog.len[ _G_syslog.count++ ] = n < DAEMOND_SYSLOG_MSG ? n : DAEMOND_SYSLOG_MSG - 1;
+
+	if (_G_syslog.count == DAEMOND_SYSLOG_BATCH || severity <= LOG_WARNING
+	|| htime() - _G_syslog.first_at >= _G_syslog.flush_interval)
+		daemond_syslog_flush_locked();
+	pthread_mutex_unlock(&_G_syslog.lock);
+}
+
+static void daemond_syslog_vtrace(int severity, const char * fmt, va_list va_args) {
+	char buf[4096], * nl;
+	size_t room = sizeof(_G_syslog_line) - _G_syslog_line_len - 1;
+	int n;
+
+	if (_G_syslog.fd == -1)
+		return;
+	n = vsnprintf(_G_syslog_line + _G_syslog_line_len, room + 1, daemond_color_fmt(fmt, 1, buf, sizeof(buf)), va_args);
+	if (n < 0)
+		return;
+	_G_syslog_line_len += (size_t)n > room ? room : (size_t)n;
+
+	while ((nl = memchr(_G_syslog_line, '\n', _G_syslog_line_len))) {
+		daemond_syslog_emit(severity, _G_syslog_line, nl - _G_syslog_line);
+		_G_syslog_line_len -= nl + 1 - _G_syslog_line;
+		memmove(_G_syslog_line, nl + 1, _G_syslog_line_len);
+	}
+	if (_G_syslog_line_len == sizeof(_G_syslog_line) - 1) {
+		daemond_syslog_emit(severity, _G_syslog_line, _G_syslog_line_len);
+		_G_syslog_line_len = 0;
+	}
+}
+
+static int daemond_syslog_severity(int fallback) {
+	switch (_G_log_level) {
+		case DAEMOND_LOG_DEBUG:  return LOG_DEBUG;
+		case DAEMOND_LOG_INFO:   return LOG_INFO;
+		case DAEMOND_LOG_NOTICE: return LOG_NOTICE;
+		case DAEMOND_LOG_WARN:   return LOG_WARNING;
+		case DAEMOND_LOG_ERR:    return LOG_ERR;
+		default:                 return fallback;
+	}
+}
+
+void daemond_syslog_tracer(const char * fmt, va_list va_args) {
+	daemond_syslog_vtrace(daemond_syslog_severity(LOG_INFO), fmt, va_args);
+}
+
+void daemond_syslog_tracer_debug(const char * fmt, va_list va_args) {
+	daemond_syslog_vtrace(daemond_syslog_severity(LOG_DEBUG), fmt, va_args);
+}
+
+void daemond_syslog_flush(void) {
+	pthread_mutex_lock(&_G_syslog.lock);
+	if (_G_syslog.fd > -1 && _G_syslog.count)
+		daemond_syslog_flush_locked();
+	pthread_mutex_unlock(&_G_syslog.lock);
+}
+
+// the batch is sent and the lock held across fork, child starts with none
+static void daemond_syslog_atfork_prepare(void) {
+	pthread_mutex_lock(&_G_syslog.lock);
+	if (_G_syslog.fd > -1 && _G_syslog.count)
+		daemond_syslog_flush_locked();
+}
+
+static void daemond_syslog_atfork_release(void) {
+	pthread_mutex_unlock(&_G_syslog.lock);
+}
+
+static void daemond_syslog_tick(void) {
+	if (_G_syslog.fd > -1 && _G_syslog.count && htime() - _G_syslog.first_at >= _G_syslog.flush_interval)
+		daemond_syslog_flush();
+}
+
+// as daemond_log_file_due()
+static double daemond_syslog_due(int shared) {
+	double left;
+	if (_G_syslog.fd == -1)
+		return -1;
+	if (!_G_syslog.count)
+		return shared ? _G_syslog.flush_interval : -1;
+	left = _G_syslog.first_at + _G_syslog.flush_interval - htime();
+	return left > 0 ? left : 0;
+}
+
+unsigned long daemond_syslog_dropped(void) {
+	return _G_syslog.dropped;
+}
+
+int daemond_syslog_open(daemond * d, const char * path, daemond_syslog_format format, int facility) {
+	static int registered = 0;
+
+	daemond_syslog_close();
+	pthread_mutex_lock(&_G_syslog.lock);
+	if (!path)
+		path = format == DAEMOND_SYSLOG_JOURNAL ? "/run/systemd/journal/socket" : "/dev/log";
+	strncpy(_G_syslog.path, path, sizeof(_G_syslog.path) - 1);
+	_G_syslog.d        = d;
+	_G_syslog.format   = format;
+	_G_syslog.facility = facility;
+	_G_syslog.count    = 0;
+	_G_syslog.dropped  = 0;
+	if (gethostname(_G_syslog.host, sizeof(_G_syslog.host) - 1) == -1 || !*_G_syslog.host)
+		strcpy(_G_syslog.host, "-");
+	if (daemond_syslog_connect() == -1) {
+		pthread_mutex_unlock(&_G_syslog.lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&_G_syslog.lock);
+
+	if (!registered) {
+		pthread_atfork(daemond_syslog_atfork_prepare, daemond_syslog_atfork_release, daemond_syslog_atfork_release);
+		atexit(daemond_syslog_flush);
+		registered = 1;
+	}
+	return 0;
+}
+
+void daemond_syslog_close(void) {
+	pthread_mutex_lock(&_G_syslog.lock);
+	if (_G_syslog.fd > -1) {
+		if (_G_syslog.count)
+			daemond_syslog_flush_locked();
+		close(_G_syslog.fd);
+		_G_syslog.fd = -1;
+	}
+	pthread_mutex_unlock(&_G_syslog.lock);
+}
+
+/*
+ * SIG functions
+ */
+
+
+volatile sig_atomic_t daemond_sig_was_received;
+volatile sig_atomic_t daemond_sig_received[NSIG];
+
+// written by the handler, master's poll wakes up even if the signal came just before it
+static int _G_sig_wake[2] = { -1, -1 };
+
+static void daemond_sig_handler(int sig) {
+	int saved = errno;
+	//debug("Signal %d received", sig);
+	if (sig < NSIG) {
+		// lock-free atomics are async-signal-safe
+		__atomic_fetch_add(&daemond_sig_received[sig], 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&daemond_sig_was_received, 1, __ATOMIC_RELEASE);
+		if (sig == SIGUSR1)
+			_G_logfile.reopen = 1;
+		if (_G_sig_wake[1] > -1 && write(_G_sig_wake[1], "", 1) == -1) {
+			// full already, master wakes up anyway
+		}
+	}
+	errno = saved;
+	// nothing else here: tracers aren't async-signal-safe
+	return;
+	/*
+	switch(sig) {
+		case SIGQUIT:
+		case SIGINT:
+			//debug("Handle sigint");
+			daemond_sig_int = 1;
+			return;
+		case SIGTERM:
+			//debug("Handle sigterm");
+			daemond_sig_term = 1;
+			return;
+		default:
+			debug("Signal %d received", sig);
+			break;
+	}
+	exit(255);
+	*/
+}
+
+//#include <sys/ucontext.h>
+
+typedef struct {
+	int     signo;
+	char   *signame;
+	int     flags;
+	char   *name;
+	void  (*handler)(int);
+	//void  (*sihandler)(int, siginfo_t *, ucontext_t *);
+	void  (*sihandler)(int, siginfo_t *, void *);
+} daemond_sig_t;
+
+daemond_sig_t signals[] = {
 	{ SIGINT,  "SIGINT",  0, "", daemond_sig_handler, 0 },
 	{ SIGTERM, "SIGTERM", 0, "", daemond_sig_handler, 0 },
 	{ SIGQUIT, "SIGQUIT", 0, "", daemond_sig_handler, 0 },
 	{ SIGCHLD, "SIGCHLD", 0, "", daemond_sig_handler, 0 },
+	{ SIGUSR1, "SIGUSR1", 0, "", daemond_sig_handler, 0 },
 	{ SIGPIPE, "SIGPIPE, SIG_IGN", 0, "", SIG_IGN, 0 },
 	{ 0,       NULL,      0, "", NULL,             NULL }
 };
 
-static void daemond_sig_set(daemond * d, daemond_sig_t * sig) {
-	struct sigaction   sa;
+static void daemond_sig_set(daemond * d, daemond_sig_t * sig) {
+	struct sigaction   sa;
+
+		bzero(&sa, sizeof(struct sigaction));
+		sa.sa_flags = sig->flags;
+		if ( sig->sihandler ) {
+			sa.sa_sigaction = sig->sihandler;
+			sa.sa_flags  |= SA_SIGINFO;
+		}
+		else
+		if( sig->handler ) {
+			sa.sa_handler = sig->handler;
+			sa.sa_flags  &= ~((unsigned int)SA_SIGINFO);
+		}
+		else {
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags  &= ~((unsigned int)SA_SIGINFO);
+		}
+
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(sig->signo, &sa, NULL) == -1) {
+			die("signal watcher sigaction(%s) failed: %s", sig->signame, ERR);
+		} else {
+			//debug("installed signal %s flags: %08x", sig->signame, sa.sa_flags);
+		}
+}
+
+static void daemond_sig_wake_close(void) {
+	if (_G_sig_wake[0] > -1) {
+		close(_G_sig_wake[0]);
+		close(_G_sig_wake[1]);
+		_G_sig_wake[0] = _G_sig_wake[1] = -1;
+	}
+}
+
+void daemond_sig_init(daemond * d) {
+
+	daemond_sig_was_received = 0;
+	memset( (void *) daemond_sig_received,0,NSIG );
+
+	daemond_sig_t     *sig;
+	//struct sigaction   sa;
+
+	// a pool process needs its own, not the one shared with master
+	daemond_sig_wake_close();
+	if (pipe(_G_sig_wake) == -1)
+		die("Can't create signal wake pipe: %s", ERR);
+	nonblock(_G_sig_wake[0]);
+	nonblock(_G_sig_wake[1]);
+
+	for (sig = signals; sig->signo != 0; sig++) {
+		daemond_sig_set(d, sig);
+	}
+}
+
+/*
+ * Daemonization functions
+ */
+
+void daemond_daemonize(daemond * d) {
+	int fd, status;//, pidf
+	pid_t pid, gone;
+	double t;
+
+	if(!d->detach)
+		return;
+	if (d->detached) {
+		warn("Process already detached");
+		return;
+	}
+
+	// open it while there is still a terminal to complain to
+	if (d->log_file && daemond_log_file_open(d->log_file, d->log_buffer, d->log_flush_interval, d->log_fsync_interval) == -1) {
+		die("Can't open log file `%s': %s", d->log_file, ERR);
+	}
+
+	switch (pid = fork()) {
+		case -1:
+			return die("fork1 failed: %s", ERR);
+		case 0: // forked child
+			break;
+		default: // parent, controlling terminal
+			//daemond_say("")
+			daemond_printf(d, "<y>waiting for %d to gone</>...", pid);
+			daemond_pid_forget(&d->pid);
+			t = htime();
+			while(1) {
+				gone = waitpid(pid, &status, WNOHANG);
+				//debug("gone = %d (%s)",gone, ERR);
+				if (gone > 0) {
+					colorprintf("<g>done</>\n");
+					break;
+				}
+				if (htime() - t > 10) {
+					colorprintf("<r>tired of waiting</>\n");
+					exit(255);
+				}
+				usleep(100000);
+				fprintf(stdout,".");
+			}
+
+			if (d->use_pid) {
+				daemond_printf(d, "<y>Reading new pid</>...");
+				t = htime();
+				while (1) {
+					pid = daemond_pid_read(&d->pid);
+					if (gone == pid) {
+						if (!file_exists( d->pid.pidfile )) {
+							colorprintf( "<r>Pidfile disappeared. Possible daemon died. Look at logs</>\n" );
+							exit(255);
+						}
+						if (htime() - t > 10) {
+							colorprintf("<r>tired of waiting</>\n");
+							exit(255);
+						}
+
+						fprintf(stdout,".");
+						usleep(100000);
+					} else {
+						colorprintf(" <g>%d</>\n", pid);
+						break;
+					}
+				}
+				daemond_printf(d, "<y>checking it's live</>...");
+				usleep(300000);
+
+				if( kill(pid,0) == 0 ) {
+					colorprintf(" <g>looks ok</>\n");
+				} else {
+					colorprintf(" <r>no process with pid %d. Look at logs\n", pid);
+					exit(255);
+				}
+			}
+			else if (d->lock_fd > -1) {
+				daemond_printf(d, "<y>Asking new pid</>...");
+				if ((pid = daemond_lock_pid(d))) {
+					colorprintf(" <g>%d</>\n", pid);
+				} else {
+					colorprintf(" <r>no answer. Look at logs</>\n");
+					exit(255);
+				}
+			}
+
+			exit(0);
+	}
+
+	//warn("i'm an intermediate process %d, fork again", getpid());
+
+	switch (pid = fork()) {
+		case -1:
+			return die("fork2 failed: %s", ERR);
+		case 0: // forked child
+			break;
+		default:
+			//warn("forked child: %d", pid);
+			exit(0);
+	}
+
+	d->detached = 1;
+	if (d->use_pid)
+		daemond_pid_relock(&d->pid);
+
+	//warn("i'm forked master process %d", getpid());
+
+	if( setsid() == -1 ) {
+		return die("setsid failed");
+	}
+
+	fd = open("/dev/null", O_RDWR);
+
+	if (fd < 0) {
+		return die("open /dev/null failed: %s", ERR);
+	}
+
+	if (dup2(fd, STDIN_FILENO) == -1) {
+		die("dup2(stdin) failed: %s",ERR);
+	}
+
+	if (dup2(fd, STDOUT_FILENO) == -1) {
+		die("dup2(stdout) failed: %s",ERR);
+	}
+
+	if (dup2(fd, STDERR_FILENO) == -1) {
+		die("dup2(stderr) failed: %s",ERR);
+	}
+
+	if (fd > STDERR_FILENO) {
+		if (close(fd) == -1) {
+			warn("close(%d) failed: %s", fd, ERR);
+		}
+	}
+
+	_G_colors_tty = -1;
+
+	if (d->log_file) {
+		daemond_set_tracer(daemond_log_file_tracer);
+		daemond_set_tracer_debug(daemond_log_file_tracer);
+	}
+
+	/*
+	fclose(stdout);
+	stdout = fdopen( STDOUT_FILENO, "w" );
+	fclose(stderr);
+	stderr = fdopen( STDERR_FILENO, "w" );
+	fclose(stdin);
+	stdin = fdopen( STDIN_FILENO, "r" );
+	*/
+}
+
+/*
+ * Metrics
+ *
+ * Counters are bumped by relaxed atomic adds wherever master sees the
+ * event; a scrape copies them field by field and formats the copy with
+ * the gauges read off d, in Prometheus text format
+ */
+
+#define DAEMOND_METRICS_BUCKETS 12
+
+static const double _G_restart_buckets[DAEMOND_METRICS_BUCKETS] = {
+	0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 5, 30
+};
+
+// uint64_t only, scraped as an array of them
+typedef struct {
+	uint64_t          forks;
+	uint64_t          failed_exits;     // non-zero exit code
+	uint64_t          deaths[NSIG];     // killed by a signal other than INT, TERM or QUIT
+	uint64_t          signals[NSIG];    // dispatched by master's loop
+	uint64_t          log_bytes[2];     // captured out, err
+	uint64_t          restarts[DAEMOND_METRICS_BUCKETS + 1]; // per bucket, last is +Inf
+	uint64_t          restart_us;       // sum of restart latencies
+} daemond_metrics;
+
+static daemond_metrics _G_metrics;
+
+#define daemond_metric_add(field, n) __atomic_fetch_add(&_G_metrics.field, (n), __ATOMIC_RELAXED)
+
+// from a worker's exit to its slot forked again
+static void daemond_metric_restart(double latency) {
+	int i;
+	for (i=0; i < DAEMOND_METRICS_BUCKETS && latency > _G_restart_buckets[i]; i++);
+	daemond_metric_add(restarts[i], 1);
+	daemond_metric_add(restart_us, (uint64_t)( latency * 1e6 ));
+}
+
+static void daemond_metrics_snapshot(daemond_metrics * m) {
+	const uint64_t * src = (const uint64_t *)&_G_metrics;
+	uint64_t * dst = (uint64_t *)m;
+	size_t i;
+	for (i=0; i < sizeof(*m) / sizeof(uint64_t); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static size_t daemond_metrics_printf(char * buf, size_t size, size_t len, const char * fmt, ...) {
+	va_list va_args;
+	int n;
+	if (len >= size)
+		return len;
+	va_start(va_args, fmt);
+	n = vsnprintf(buf + len, size - len, fmt, va_args);
+	va_end(va_args);
+	return n < 0 ? len : len + n;
+}
+
+#define metric_head(name, type, help) \
+	len = daemond_metrics_printf(buf, size, len, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+#define metric(fmt, ...) \
+	len = daemond_metrics_printf(buf, size, len, fmt "\n", ##__VA_ARGS__)
+
+int daemond_metrics_format(daemond * d, char * buf, size_t size) {
+	daemond_metrics m;
+	uint64_t cumulative = 0, dropped[2] = { 0, 0 };
+	size_t len = 0;
+	int i;
+
+	daemond_metrics_snapshot(&m);
+	for (i=0; d->slots && i < d->children_max; i++) {
+		dropped[0] += d->slots[i].out.dropped;
+		dropped[1] += d->slots[i].err.dropped;
+	}
+
+	metric_head("daemond_forks_total", "counter", "Worker processes forked.");
+	metric("daemond_forks_total %llu", (unsigned long long)m.forks);
+
+	metric_head("daemond_worker_failed_exits_total", "counter", "Workers exited with non-zero code.");
+	metric("daemond_worker_failed_exits_total %llu", (unsigned long long)m.failed_exits);
+
+	metric_head("daemond_worker_deaths_total", "counter", "Workers killed by a signal other than INT, TERM or QUIT.");
+	for (i=1; i < NSIG; i++) {
+		if (m.deaths[i])
+			metric("daemond_worker_deaths_total{signal=\"%s\"} %llu", signame(i), (unsigned long long)m.deaths[i]);
+	}
+
+	metric_head("daemond_restart_latency_seconds", "histogram", "From a worker's exit to its slot forked again.");
+	for (i=0; i < DAEMOND_METRICS_BUCKETS; i++) {
+		cumulative += m.restarts[i];
+		metric("daemond_restart_latency_seconds_bucket{le=\"%g\"} %llu", _G_restart_buckets[i], (unsigned long long)cumulative);
+	}
+	cumulative += m.restarts[DAEMOND_METRICS_BUCKETS];
+	metric("daemond_restart_latency_seconds_bucket{le=\"+Inf\"} %llu", (unsigned long long)cumulative);
+	metric("daemond_restart_latency_seconds_sum %.6f", m.restart_us / 1e6);
+	metric("daemond_restart_latency_seconds_count %llu", (unsigned long long)cumulative);
+
+	metric_head("daemond_restart_interval_seconds", "gauge", "Current restart interval, raised by backoff.");
+	metric("daemond_restart_interval_seconds %g", d->restart_interval);
+
+	metric_head("daemond_respawn_pending", "gauge", "Forks wait for the restart interval.");
+	metric("daemond_respawn_pending %d", daemond_timer_pending(&d->respawn) ? 1 : 0);
+
+	metric_head("daemond_workers_running", "gauge", "Workers running.");
+	metric("daemond_workers_running %d", d->children_running);
+
+	metric_head("daemond_workers_configured", "gauge", "Workers master keeps running.");
+	metric("daemond_workers_configured %d", d->children_count);
+
+	metric_head("daemond_signals_total", "counter", "Signals dispatched by master.");
+	for (i=1; i < NSIG; i++) {
+		if (m.signals[i])
+			metric("daemond_signals_total{signal=\"%s\"} %llu", signame(i), (unsigned long long)m.signals[i]);
+	}
+
+	metric_head("daemond_log_bytes_total", "counter", "Bytes of captured worker output read by master.");
+	metric("daemond_log_bytes_total{stream=\"out\"} %llu", (unsigned long long)m.log_bytes[0]);
+	metric("daemond_log_bytes_total{stream=\"err\"} %llu", (unsigned long long)m.log_bytes[1]);
+
+	metric_head("daemond_log_dropped_bytes_total", "counter", "Bytes of captured worker output dropped.");
+	metric("daemond_log_dropped_bytes_total{stream=\"out\"} %llu", (unsigned long long)dropped[0]);
+	metric("daemond_log_dropped_bytes_total{stream=\"err\"} %llu", (unsigned long long)dropped[1]);
+
+	if (len >= size) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return len;
+}
+
+#undef metric_head
+#undef metric
+
+/*
+ * Endpoint: HTTP/1.0 on "host:port" (numeric, loopback meant), unix socket
+ * path or "@name" of an abstract one. Answered the way the instance socket
+ * is, each scrape in one go with short timeouts
+ */
+
+static int daemond_metrics_listen(daemond * d) {
+	const char * spec = d->metrics_listen;
+	struct sockaddr_storage ss;
+	struct sockaddr_un * sun = (struct sockaddr_un *)&ss;
+	struct addrinfo hints, * ai = NULL;
+	char host[256];
+	const char * port;
+	socklen_t len;
+	struct stat st;
+	int fd, one = 1;
+
+	bzero(&ss, sizeof(ss));
+	if (spec[0] == '/' || spec[0] == '@') {
+		if (strlen(spec) >= sizeof(sun->sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, spec);
+		len = offsetof(struct sockaddr_un, sun_path) + strlen(spec) + ( spec[0] == '/' );
+		if (spec[0] == '@')
+			sun->sun_path[0] = 0;
+		// a socket left by the previous master
+		else if (stat(spec, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(spec);
+	}
+	else {
+		if (!(port = strrchr(spec, ':'))) {
+			port = spec;
+			strcpy(host, "127.0.0.1");
+		}
+		else {
+			snprintf(host, sizeof(host), "%.*s", (int)( port - spec ), spec);
+			port++;
+		}
+		if (host[0] == '[') {
+			memmove(host, host + 1, strlen(host));
+			host[strcspn(host, "]")] = 0;
+		}
+		bzero(&hints, sizeof(hints));
+		hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(*host ? host : "127.0.0.1", port, &hints, &ai) != 0 || ai->ai_addrlen > sizeof(ss)) {
+			if (ai)
+				freeaddrinfo(ai);
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(&ss, ai->ai_addr, ai->ai_addrlen);
+		len = ai->ai_addrlen;
+		freeaddrinfo(ai);
+	}
+
+	if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) == -1)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	nonblock(fd);
+	if (ss.ss_family != AF_UNIX)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&ss, len) == -1 || listen(fd, 16) == -1) {
+		close(fd);
+		return -1;
+	}
+	d->metrics_fd = fd;
+	return 0;
+}
+
+/*
+ * Scrapers are accepted non-blocking; one whose request isn't there yet
+ * waits in a small table polled by master's loop, for DAEMOND_METRICS_WAIT
+ * seconds at most
+ */
+
+#define DAEMOND_METRICS_CONNS 8
+#define DAEMOND_METRICS_WAIT  1.0
+
+static struct {
+	int               fd;
+	double            since;
+} _G_metrics_conns[DAEMOND_METRICS_CONNS];
+static int _G_metrics_conns_count = 0;
+
+// answers a scraper, returns 0 if its request didn't come yet
+static int daemond_metrics_reply(daemond * d, int fd) {
+	char req[1024], head[160], body[32768];
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t r;
+	int len;
+
+	while ((r = read(fd, req, sizeof(req) - 1)) == -1 && errno == EINTR);
+	if (r == -1 && errno == EAGAIN)
+		return 0;
+	if (r > 0) {
+		req[r] = 0;
+		if (strncmp(req, "GET ", 4) != 0) {
+			len = 0;
+			iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+		}
+		else if ((len = daemond_metrics_format(d, body, sizeof(body))) == -1) {
+			len = 0;
+			iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+		}
+		else {
+			iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+		}
+		iov[0].iov_base = head;
+		iov[1].iov_base = body;
+		iov[1].iov_len  = len;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = 2;
+		// scraper may be gone or not reading, that must not stall master
+		if ((r = sendmsg(fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT)) == -1)
+			debug("Metrics reply failed: %s", ERR);
+		else if ((size_t)r < iov[0].iov_len + len)
+			debug("Metrics reply cut to %zd of %zu bytes", r, iov[0].iov_len + len);
+	}
+	close(fd);
+	return 1;
+}
+
+// called when the metrics socket is readable
+static void daemond_metrics_serve(daemond * d) {
+	int fd;
+
+	while ((fd = accept4(d->metrics_fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK)) > -1) {
+		if (daemond_metrics_reply(d, fd))
+			continue;
+		if (_G_metrics_conns_count == DAEMOND_METRICS_CONNS) {
+			debug("Too many metrics scrapers waiting, closing %d", fd);
+			close(fd);
+			continue;
+		}
+		_G_metrics_conns[_G_metrics_conns_count].fd = fd;
+		_G_metrics_conns[_G_metrics_conns_count++].since = htime();
+	}
+}
+
+// answers the waiting scraper fd once readable, drops those out of time
+static void daemond_metrics_pending(daemond * d, int fd) {
+	double now = htime();
+	int i = 0, done;
+
+	while (i < _G_metrics_conns_count) {
+		if (_G_metrics_conns[i].fd == fd)
+			done = daemond_metrics_reply(d, fd);
+		else if (( done = now - _G_metrics_conns[i].since >= DAEMOND_METRICS_WAIT ))
+			close(_G_metrics_conns[i].fd);
+		if (done)
+			_G_metrics_conns[i] = _G_metrics_conns[--_G_metrics_conns_count];
+		else
+			i++;
+	}
+}
+
+static void daemond_metrics_close(daemond * d) {
+	while (_G_metrics_conns_count > 0)
+		close(_G_metrics_conns[--_G_metrics_conns_count].fd);
+	if (d->metrics_fd > -1) {
+		close(d->metrics_fd);
+		d->metrics_fd = -1;
+	}
+}
+
+/*
+ * STDIN/ERR functions
+ */
+
+static void nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1){
+		die("fcntl get failed: %s",ERR);
+	}
+	if( fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		die("fcntl set failed: %s",ERR);
+	}
+	return;
+}
+
+void daemond_log_std_intercept(daemond * d) {
+	int fds[2];
+	int outf,errf;
+	if( pipe(fds) == -1 ) die("Can't create pipe for STDOUT interception: %s",ERR);
+	d->stdout_fd = fds[0];outf = fds[1];
+	if( pipe(fds) == -1 ) die("Can't create pipe for STDOUT interception: %s",ERR);
+	d->stderr_fd = fds[0];errf = fds[1];
+	if (dup2( outf, STDOUT_FILENO ) == -1)
+		die("Can't dup2 piped stdout: %s", ERR);
+	//if (dup2(errf, STDERR_FILENO ) == -1)
+	//	die("Can't dup2 piped stderr: %s", ERR);
+	nonblock(d->stdout_fd);
+	//nonblock(d->stderr_fd);
+}
+
+void daemond_log_std_read(daemond * d) {
+	char buf[DAEMOND_LOG_BUF];
+	bzero(buf,DAEMOND_LOG_BUF);
+	char *p,*end, *nl;
+	ssize_t got, cut;
+	p = end = buf; end += DAEMOND_LOG_BUF-1;
 
-		bzero(&sa, sizeof(struct sigaction));
-		sa.sa_flags = sig->flags;
-		if ( sig->sihandler ) {
-			sa.sa_sigaction = sig->sihandler;
-			sa.sa_flags  |= SA_SIGINFO;
+	fflush(stdout);
+	fflush(stderr);
+
+	while(1) {
+		got = read(d->stdout_fd, p, end - p);
+		if (got > 0) {
+			//debug("read %d bytes: '%s'",got, buf);
+			p += got;
+			while(p > buf) {
+				if ((nl = strchr(buf, '\n'))) {
+					cut = nl-buf+1;
+					debug("got single string: '%-.*s'", cut,buf);
+					memmove(buf, buf + cut, p - buf + 1);
+					p -= cut;
+				} else {
+					if (p > buf) {
+						debug("left string: '%s'",buf);
+					}
+					break;
+				}
+			}
 		}
-		else
-		if( sig->handler ) {
-			sa.sa_handler = sig->handler;
-			sa.sa_flags  &= ~((unsigned int)SA_SIGINFO);
+		else if (got == 0) {
+			debug("no more bytes");
+			break;
 		}
 		else {
-			sa.sa_handler = SIG_DFL;
-			sa.sa_flags  &= ~((unsigned int)SA_SIGINFO);
+			switch(errno) {
+				case EAGAIN: // no more data;
+					return;
+				case EINTR: // try again now
+					break;
+				default:
+					die("read failed: %s",ERR);
+			}
 		}
+	}
+	return;
+}
 
-		sigemptyset(&sa.sa_mask);
-		if (sigaction(sig->signo, &sa, NULL) == -1) {
-			die("signal watcher sigaction(%s) failed: %s", sig->signame, ERR);
-		} else {
-			//debug("installed signal %s flags: %08x", sig->signame, sa.sa_flags);
-		}
+/*
+ * Per slot output capture
+ */
+
+static void daemond_std_pipe(daemond * d, int fds[2]) {
+	if( pipe(fds) == -1 ) die("Can't create pipe for slot output capture: %s",ERR);
+#ifdef F_SETPIPE_SZ
+	if (d->std_pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, d->std_pipe_size) == -1)
+		ewarn("Can't resize capture pipe to %d bytes", d->std_pipe_size);
+#endif
 }
 
-void daemond_sig_init(daemond * d) {
+static void daemond_std_emit(daemond * d, int slot, const char * stream, const char * line, size_t len) {
+	colorprintf("<n>[slot %d pid %d %s]</> %.*s\n", slot, d->slots[slot].pid, stream, (int)len, line);
+}
 
-	daemond_sig_was_received = 0;
-	memset( (void *) daemond_sig_received,0,NSIG );
+/*
+ * Unframed capture: bytes are moved pipe to std_fd by the kernel, falling
+ * back to read/write when the destination can't be spliced into (O_APPEND
+ * files, ttys, non linux). A full destination marks the stream blocked:
+ * data stays in the slot pipe, or what was read already in the ring, and
+ * master polls the destination instead of the pipe until it takes more
+ */
+static int _G_std_splice = 1;
 
-	daemond_sig_t     *sig;
-	//struct sigaction   sa;
+static size_t daemond_std_flush(daemond * d, int slot, daemond_std * std, const char * stream, size_t budget);
 
-	for (sig = signals; sig->signo != 0; sig++) {
-		daemond_sig_set(d, sig);
+static int daemond_std_writable(int fd) {
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	return poll(&pfd, 1, 0) != 0;
+}
+
+static void daemond_std_passthrough(daemond * d, int slot, daemond_std * std, const char * stream) {
+	int dst = d->std_fd > -1 ? d->std_fd : STDOUT_FILENO;
+	char buf[65536], *p;
+	size_t size = d->std_overflow < sizeof(buf) ? d->std_overflow : sizeof(buf);
+	ssize_t got, w;
+
+	std->blocked = 0;
+	if (std->ring_len && daemond_std_flush(d, slot, std, stream, (size_t)-1)) {
+		std->blocked = 1;
+		return;
+	}
+	while (std->fd > -1) {
+#ifdef SPLICE_F_MOVE
+		if (_G_std_splice) {
+			got = splice(std->fd, NULL, dst, NULL, 1 << 20, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if (got == -1 && errno == EINVAL) {
+				debug("Can't splice into fd %d, copying capture", dst);
+				_G_std_splice = 0;
+				continue;
+			}
+			// either side may be the one not ready
+			if (got == -1 && errno == EAGAIN && !daemond_std_writable(dst))
+				std->blocked = 1;
+		}
+		else
+#endif
+		if ((got = read(std->fd, buf, size)) > 0) {
+			for (p = buf; p < buf + got; p += w) {
+				if ((w = write(dst, p, buf + got - p)) > -1)
+					continue;
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				if (errno != EAGAIN) {
+					debug_ratelimited(10, 1, "Write of slot %d %s to fd %d failed: %s", slot, stream, dst, ERR);
+					std->dropped += buf + got - p;
+				}
+				// the rest is kept until the destination takes more
+				else if (std->ring || ( std->ring = malloc(size) )) {
+					memcpy(std->ring, p, buf + got - p);
+					std->ring_off = 0;
+					std->ring_len = buf + got - p;
+					std->blocked  = 1;
+				}
+				else {
+					std->dropped += buf + got - p;
+				}
+				break;
+			}
+		}
+		if (got > 0) {
+			daemond_metric_add(log_bytes[std == &d->slots[slot].err], got);
+			if (std->blocked)
+				return;
+			continue;
+		}
+		if (got == 0) {
+			close(std->fd);
+			std->fd = -1;
+		}
+		else {
+			switch(errno) {
+				case EAGAIN:
+					return;
+				case EINTR:
+					break;
+				default:
+					ewarn("passthrough of slot %d %s failed", slot, stream);
+					close(std->fd);
+					std->fd = -1;
+			}
+		}
+	}
+}
+
+// emits complete lines gathered in std->buf, keeps the unterminated rest
+static void daemond_std_split(daemond * d, int slot, daemond_std * std, const char * stream) {
+	char *p = std->buf, *nl, *end = std->buf + std->len;
+
+	while ((nl = memchr(p, '\n', end - p))) {
+		daemond_std_emit(d, slot, stream, p, nl - p);
+		p = nl + 1;
+	}
+	std->len = end - p;
+	if (std->len == DAEMOND_LOG_BUF) {
+		// no newline in the whole buffer, pass it as is
+		daemond_std_emit(d, slot, stream, std->buf, std->len);
+		std->len = 0;
+	}
+	else if (std->len && p > std->buf) {
+		memmove(std->buf, p, std->len);
 	}
 }
 
 /*
- * Daemonization functions
+ * Drop policies: master reads the slot pipes into a per stream ring at any
+ * pace of its own output, so a worker never waits in write() for the log.
+ * With the ring full either incoming or oldest bytes are dropped and
+ * counted. Output goes on in DAEMOND_STD_BUDGET portions between reads
  */
 
-void daemond_daemonize(daemond * d) {
-	int fd, status;//, pidf
-	pid_t pid, gone;
-	double t;
+#define DAEMOND_STD_BUDGET (64 * 1024)
 
-	if(!d->detach)
+static void daemond_std_fill(daemond * d, int slot, daemond_std * std, const char * stream) {
+	char scratch[DAEMOND_LOG_BUF], * to;
+	size_t size = d->std_overflow, at, room, cut;
+	ssize_t got;
+
+	while (std->fd > -1) {
+		if (std->ring_len == size && d->std_policy == DAEMOND_STD_DROP_OLDEST) {
+			cut = size < DAEMOND_LOG_BUF ? size : DAEMOND_LOG_BUF;
+			std->ring_off  = (std->ring_off + cut) % size;
+			std->ring_len -= cut;
+			std->dropped  += cut;
+		}
+		if (std->ring_len == size) {
+			to = scratch; room = sizeof(scratch);
+		}
+		else {
+			at   = (std->ring_off + std->ring_len) % size;
+			room = size - std->ring_len;
+			if (room > size - at) room = size - at;
+			to = std->ring + at;
+		}
+		got = read(std->fd, to, room);
+		if (got > 0) {
+			daemond_metric_add(log_bytes[std == &d->slots[slot].err], got);
+			if (to == scratch)
+				std->dropped  += got;
+			else
+				std->ring_len += got;
+		}
+		else if (got == 0) {
+			close(std->fd);
+			std->fd = -1;
+		}
+		else {
+			switch(errno) {
+				case EAGAIN: // no more data
+					return;
+				case EINTR:
+					break;
+				default:
+					ewarn("read of slot %d %s failed", slot, stream);
+					close(std->fd);
+					std->fd = -1;
+			}
+		}
+	}
+}
+
+// passes up to budget bytes of the ring on, returns how many are left there
+static size_t daemond_std_flush(daemond * d, int slot, daemond_std * std, const char * stream, size_t budget) {
+	size_t size = d->std_overflow, n;
+	ssize_t w;
+
+	while (std->ring_len && budget) {
+		n = size - std->ring_off;
+		if (n > std->ring_len) n = std->ring_len;
+		if (n > budget) n = budget;
+		if (d->std_prefix) {
+			if (n > DAEMOND_LOG_BUF - std->len) n = DAEMOND_LOG_BUF - std->len;
+			memcpy(std->buf + std->len, std->ring + std->ring_off, n);
+			std->len += n;
+			daemond_std_split(d, slot, std, stream);
+		}
+		else if ((w = write(d->std_fd > -1 ? d->std_fd : STDOUT_FILENO, std->ring + std->ring_off, n)) > -1) {
+			n = w;
+		}
+		else if (errno == EINTR) {
+			continue;
+		}
+		else if (errno == EAGAIN) {
+			break;
+		}
+		else {
+			debug_ratelimited(10, 1, "Write of slot %d %s failed: %s", slot, stream, ERR);
+			std->dropped += n;
+		}
+		std->ring_off  = (std->ring_off + n) % size;
+		std->ring_len -= n;
+		budget -= n;
+	}
+	if (!std->ring_len && std->fd == -1 && std->len) {
+		daemond_std_emit(d, slot, stream, std->buf, std->len);
+		std->len = 0;
+	}
+	return std->ring_len;
+}
+
+// periodic marker of what was lost since the previous one, 1 if any
+static int daemond_std_report(daemond * d, int slot) {
+	daemond_std * std[2] = { &d->slots[slot].out, &d->slots[slot].err };
+	int i, reported = 0;
+	for (i=0; i < 2; i++) {
+		if (std[i]->dropped > std[i]->dropped_reported) {
+			colorprintf("<r>[slot %d pid %d %s] %zu bytes dropped</>\n", slot, d->slots[slot].pid, i ? "err" : "out",
+				std[i]->dropped - std[i]->dropped_reported);
+			std[i]->dropped_reported = std[i]->dropped;
+			reported = 1;
+		}
+	}
+	return reported;
+}
+
+static void daemond_std_drain(daemond * d, int slot, daemond_std * std, const char * stream) {
+	ssize_t got;
+
+	if (d->std_policy != DAEMOND_STD_BLOCK) {
+		daemond_std_fill(d, slot, std, stream);
+		daemond_std_flush(d, slot, std, stream, DAEMOND_STD_BUDGET);
 		return;
-	if (d->detached) {
-		warn("Process already detached");
+	}
+	if (!d->std_prefix) {
+		daemond_std_passthrough(d, slot, std, stream);
 		return;
 	}
 
-	switch (pid = fork()) {
-		case -1:
-			return die("fork1 failed: %s", ERR);
-		case 0: // forked child
-			break;
-		default: // parent, controlling terminal
-			//daemond_say("")
-			daemond_printf(d, "<y>waiting for %d to gone</>...", pid);
-			daemond_pid_forget(&d->pid);
-			t = htime();
-			while(1) {
-				gone = waitpid(pid, &status, WNOHANG);
-				//debug("gone = %d (%s)",gone, ERR);
-				if (gone > 0) {
-					colorprintf("<g>done</>\n");
+	while (std->fd > -1) {
+		got = read(std->fd, std->buf + std->len, DAEMOND_LOG_BUF - std->len);
+		if (got > 0) {
+			daemond_metric_add(log_bytes[std == &d->slots[slot].err], got);
+			std->len += got;
+			daemond_std_split(d, slot, std, stream);
+		}
+		else if (got == 0) {
+			if (std->len) {
+				daemond_std_emit(d, slot, stream, std->buf, std->len);
+				std->len = 0;
+			}
+			close(std->fd);
+			std->fd = -1;
+		}
+		else {
+			switch(errno) {
+				case EAGAIN: // no more data
+					return;
+				case EINTR:
 					break;
-				}
-				if (htime() - t > 10) {
-					colorprintf("<r>tired of waiting</>\n");
-					exit(255);
-				}
-				usleep(100000);
-				fprintf(stdout,".");
+				default:
+					ewarn("read of slot %d %s failed", slot, stream);
+					close(std->fd);
+					std->fd = -1;
+					std->len = 0;
 			}
+		}
+	}
+}
 
-			if (d->use_pid) {
-				daemond_printf(d, "<y>Reading new pid</>...");
-				t = htime();
-				while (1) {
-					pid = daemond_pid_read(&d->pid);
-					if (gone == pid) {
-						if (!file_exists( d->pid.pidfile )) {
-							colorprintf( "<r>Pidfile disappeared. Possible daemon died. Look at logs</>\n" );
-							exit(255);
-						}
-						if (htime() - t > 10) {
-							colorprintf("<r>tired of waiting</>\n");
-							exit(255);
-						}
+// flushes whatever previous owner of the slot left in pipes
+static void daemond_std_close(daemond * d, int slot) {
+	daemond_std * std[2] = { &d->slots[slot].out, &d->slots[slot].err };
+	const char * stream[2] = { "out", "err" };
+	int i, left;
+	for (i=0; i < 2; i++) {
+		if (std[i]->fd > -1)
+			daemond_std_drain(d, slot, std[i], stream[i]);
+		if (std[i]->ring) {
+			std[i]->dropped += daemond_std_flush(d, slot, std[i], stream[i], (size_t)-1);
+			std[i]->ring_off = std[i]->ring_len = 0;
+		}
+#ifdef FIONREAD
+		// what a full destination left in the pipe is lost with it
+		if (std[i]->blocked && std[i]->fd > -1 && ioctl(std[i]->fd, FIONREAD, &left) == 0 && left > 0)
+			std[i]->dropped += left;
+#endif
+		std[i]->blocked = 0;
+		if (std[i]->fd > -1) { close(std[i]->fd); std[i]->fd = -1; }
+		std[i]->len = 0;
+	}
+	daemond_std_report(d, slot);
+}
 
-						fprintf(stdout,".");
-						usleep(100000);
-					} else {
-						colorprintf(" <g>%d</>\n", pid);
-						break;
-					}
-				}
-				daemond_printf(d, "<y>checking it's live</>...");
-				usleep(300000);
+// child side: redirect stdout/stderr into the slot pipes, drop master's ends
+static void daemond_std_attach(daemond * d, int out, int err) {
+	int i;
+	fflush(stdout);
+	fflush(stderr);
+	if (dup2( out, STDOUT_FILENO ) == -1)
+		die("Can't dup2 captured stdout: %s", ERR);
+	if (dup2( err, STDERR_FILENO ) == -1)
+		die("Can't dup2 captured stderr: %s", ERR);
+	close(out);
+	close(err);
+	_G_colors_tty = -1;
+	for (i=0; i < d->children_max; i++) {
+		if (d->slots[i].out.fd > -1) close(d->slots[i].out.fd);
+		if (d->slots[i].err.fd > -1) close(d->slots[i].err.fd);
+	}
+}
+
+static daemond_flight_ring * daemond_flight_ring_of(daemond * d, int slot) {
+	return (daemond_flight_ring *)( (char *)d->flight + slot * ( sizeof(daemond_flight_ring) + d->flight_records * sizeof(daemond_flight_rec) ) );
+}
+
+static void daemond_flight_init(daemond * d) {
+	size_t size = d->children_max * ( sizeof(daemond_flight_ring) + d->flight_records * sizeof(daemond_flight_rec) );
+	int i;
+	d->flight = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (d->flight == MAP_FAILED)
+		die("Can't map flight recorder of %zu bytes: %s", size, ERR);
+	for (i=0; i < d->children_max; i++) {
+		daemond_flight_ring_of(d, i)->records = d->flight_records;
+	}
+}
+
+/*
+ * Prints the last records of the slot, called once its worker died. The
+ * ring is writable by the worker, so every record is copied out and
+ * checked before use and the depth is master's own. A record is a whole
+ * message, printed as a line of its own whether it ends with one or not
+ */
+static void daemond_flight_dump(daemond * d, int slot, pid_t pid) {
+	daemond_flight_ring * ring = daemond_flight_ring_of(d, slot);
+	daemond_flight_rec rec;
+	uint64_t records = d->flight_records, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), idx;
+	char fmt[4096], text[4096], * line, * nl;
+	int n;
+
+	if (!head)
+		return;
+	debug_output(DAEMOND_LOG_WARN, "[%d] last %llu records of slot %d pid %d:\n", getpid(),
+		(unsigned long long)( head < records ? head : records ), slot, pid);
+	for (idx = head > records ? head - records : 0; idx < head; idx++) {
+		if (__atomic_load_n(&ring->rec[ idx % records ].seq, __ATOMIC_ACQUIRE) != idx + 1)
+			continue; // torn by the crash
+		memcpy(&rec, &ring->rec[ idx % records ], sizeof(rec));
+		if (rec.flen >= DAEMOND_FLIGHT_FMT || rec.len > sizeof(rec.data) - rec.flen - 1)
+			continue;
+		rec.data[rec.flen] = 0;
+		daemond_colorize((char *)rec.data, fmt, sizeof(fmt), 1);
+		if ((n = daemond_binlog_format(text, sizeof(text), fmt, rec.data + rec.flen + 1, rec.len)) == -1)
+			n = snprintf(text, sizeof(text), "<truncated record \"%s\">", fmt);
+		if (n >= (int)sizeof(text))
+			n = sizeof(text) - 1;
+		while (n > 0 && text[n - 1] == '\n')
+			n--;
+		text[n] = 0;
+		for (line = text; line; line = nl) {
+			if ((nl = strchr(line, '\n')))
+				*nl++ = 0;
+			debug_output(DAEMOND_LOG_WARN, "[slot %d pid %d flight] %lld.%06u %s\n", slot, pid,
+				(long long)rec.sec, rec.usec, line);
+		}
+	}
+}
+
+static int daemond_slot_of(daemond * d, pid_t pid) {
+	int i;
+	for (i=0; i < d->children_max; i++) {
+		if (d->children[i] == pid)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Thread workers
+ *
+ * With d->worker set master starts children_count threads running it
+ * instead of forking. Workers have all signals blocked, so handlers run on
+ * master's thread; a returning worker wakes master through a pipe to be
+ * joined and, on non-zero result, started again after restart_interval
+ */
+
+typedef struct {
+	daemond         * d;
+	int               slot;
+	pthread_t         tid;
+	int               started;  // not joined yet
+	pid_t             os_tid;   // kernel's thread id, linux
+	int               running;  // cleared by the worker on return
+	int               stop;     // set by master
+	int               done;     // returned 0 unasked, slot is not refilled
+	int               result;
+	int               stop_fd[2];
+} daemond_thread;
+
+typedef struct {
+	int               wake[2];  // written by a returning worker
+	daemond_thread    slot[];
+} daemond_threads;
+
+// hybrid: a pool's counters in MAP_SHARED memory, written by the pool
+typedef struct {
+	int32_t           threads;
+	int32_t           running;
+	uint32_t          restarts;
+	uint32_t          pad;
+} daemond_health;
+
+static __thread daemond_thread * _G_thread = NULL;
+
+int daemond_stopping(daemond * d) {
+	return _G_thread ? __atomic_load_n(&_G_thread->stop, __ATOMIC_ACQUIRE) : 0;
+}
+
+int daemond_stop_fd(daemond * d) {
+	return _G_thread ? _G_thread->stop_fd[0] : -1;
+}
+
+static void daemond_thread_name(daemond * d, int slot) {
+	char name[16]; // linux limit with the terminator
+	snprintf(name, sizeof(name), "%.10s/%d", d->name ? d->name : "worker", slot);
+#if defined(__linux__)
+	pthread_setname_np(pthread_self(), name);
+#elif defined(__APPLE__)
+	pthread_setname_np(name);
+#endif
+}
+
+static void * daemond_thread_main(void * arg) {
+	daemond_thread * t = arg;
+	char c = 0;
+	_G_thread = t;
+#ifdef SYS_gettid
+	__atomic_store_n(&t->os_tid, (pid_t)syscall(SYS_gettid), __ATOMIC_RELAXED);
+#endif
+	daemond_thread_name(t->d, t->slot);
+	t->result = t->d->worker(t->d, t->slot, t->d->worker_arg);
+	__atomic_store_n(&t->running, 0, __ATOMIC_RELEASE);
+	if (write(((daemond_threads *)t->d->threads)->wake[1], &c, 1) == -1 && errno != EAGAIN)
+		ewarn("thread of slot %d can't wake master", t->slot);
+	return NULL;
+}
 
-				if( kill(pid,0) == 0 ) {
-					colorprintf(" <g>looks ok</>\n");
-				} else {
-					colorprintf(" <r>no process with pid %d. Look at logs\n", pid);
-					exit(255);
-				}
-			}
+static void daemond_threads_init(daemond * d) {
+	daemond_threads * th;
+	int i;
+	if (!( th = calloc(1, sizeof(*th) + d->children_max * sizeof(daemond_thread)) ))
+		die("Can't allocate %d worker threads: %s", d->children_max, ERR);
+	if (pipe(th->wake) == -1)
+		die("Can't create threads wake pipe: %s", ERR);
+	nonblock(th->wake[0]);
+	nonblock(th->wake[1]);
+	for (i=0; i < d->children_max; i++) {
+		th->slot[i].d    = d;
+		th->slot[i].slot = i;
+		if (pipe(th->slot[i].stop_fd) == -1)
+			die("Can't create stop pipe of slot %d: %s", i, ERR);
+		nonblock(th->slot[i].stop_fd[0]);
+		nonblock(th->slot[i].stop_fd[1]);
+	}
+	d->threads = th;
+}
 
-			exit(0);
+static void daemond_thread_start(daemond * d, int slot) {
+	daemond_thread * t = &((daemond_threads *)d->threads)->slot[slot];
+	sigset_t all, old;
+	char buf[64];
+	int r;
+
+	while (read(t->stop_fd[0], buf, sizeof(buf)) > 0);
+	t->os_tid  = 0;
+	t->stop    = 0;
+	t->result  = 0;
+	t->running = 1;
+	// created threads inherit the mask
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&t->tid, NULL, daemond_thread_main, t);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r != 0) {
+		errno = r;
+		die("Can't start thread of slot %d: %s", slot, ERR);
 	}
+	t->started = 1;
+	d->children_running++;
+	daemond_status_slot_set(d, slot, getpid(), DAEMOND_STATE_RUNNING, 0);
+}
 
-	//warn("i'm an intermediate process %d, fork again", getpid());
+// worker of the slot: thread id (or master's pid) for a thread, 0 - empty
+static pid_t daemond_slot_pid(daemond * d, int slot) {
+	daemond_thread * t;
+	pid_t tid;
+	if (!d->threads)
+		return d->children[slot];
+	t = &((daemond_threads *)d->threads)->slot[slot];
+	if (!t->started)
+		return 0;
+	tid = __atomic_load_n(&t->os_tid, __ATOMIC_RELAXED);
+	return tid ? tid : getpid();
+}
 
-	switch (pid = fork()) {
-		case -1:
-			return die("fork2 failed: %s", ERR);
-		case 0: // forked child
-			break;
-		default:
-			//warn("forked child: %d", pid);
-			exit(0);
+// asks worker of the slot to finish, TERM for a process: 1 - asked, 0 - empty slot
+static int daemond_slot_stop(daemond * d, int slot) {
+	daemond_thread * t;
+	if (!d->threads) {
+		if (!d->children[slot])
+			return 0;
+		return kill(d->children[slot], SIGTERM) == -1 ? -1 : 1;
 	}
+	t = &((daemond_threads *)d->threads)->slot[slot];
+	if (!t->started)
+		return 0;
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	if (write(t->stop_fd[1], "", 1) == -1 && errno != EAGAIN)
+		return -1;
+	return 1;
+}
 
-	d->detached = 1;
-	if (d->use_pid)
-		daemond_pid_relock(&d->pid);
-
-	//warn("i'm forked master process %d", getpid());
+static void daemond_threads_reap(daemond * d) {
+	daemond_threads * th = d->threads;
+	daemond_thread * t;
+	char buf[64];
+	int i, joined = 0, died = 0;
+
+	while (read(th->wake[0], buf, sizeof(buf)) > 0);
+	for (i=0; i < d->children_max; i++) {
+		t = &th->slot[i];
+		if (!t->started || __atomic_load_n(&t->running, __ATOMIC_ACQUIRE))
+			continue;
+		pthread_join(t->tid, NULL);
+		t->started = 0;
+		d->children_running--;
+		joined++;
+		daemond_status_slot_set(d, i, 0, DAEMOND_STATE_EXITED, t->result);
+		if (t->result) {
+			debug_ratelimited(10, 1, "Thread of slot %d failed with %d", i, t->result);
+			died = 1;
+			if (d->health)
+				__atomic_fetch_add(&((daemond_health *)d->health)[d->slot].restarts, 1, __ATOMIC_RELAXED);
+		}
+		else if (!t->stop) {
+			debug("Thread of slot %d finished", i);
+			t->done = 1;
+		}
+	}
+	if (joined)
+		daemond_respawn_backoff(d, died);
+}
 
-	if( setsid() == -1 ) {
-		return die("setsid failed");
+static void daemond_check_threads(daemond * d) {
+	daemond_thread * t;
+	int i, running = 0, done = 0;
+	for (i=0; i < d->children_max; i++) {
+		t = &((daemond_threads *)d->threads)->slot[i];
+		if (t->started)
+			running++;
+		else if (t->done)
+			done += i < d->children_count;
+		else if (i < d->children_count && !d->draining && !daemond_timer_pending(&d->respawn)) {
+			daemond_thread_start(d, i);
+			running++;
+		}
+	}
+	if (d->children_running != running) {
+		d->children_running = running;
+		daemond_status_master_set(d, DAEMOND_STATE_RUNNING);
 	}
+	if (d->health)
+		__atomic_store_n(&((daemond_health *)d->health)[d->slot].running, running, __ATOMIC_RELAXED);
+	if (!running && d->children_count && done == d->children_count && !d->draining) {
+		debug("All %d threads finished", done);
+		d->draining = 1;
+	}
+}
 
-	fd = open("/dev/null", O_RDWR);
+static void daemond_health_init(daemond * d) {
+	daemond_health * h = mmap(NULL, d->children_max * sizeof(daemond_health), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (h == MAP_FAILED)
+		die("Can't map health of %d pools: %s", d->children_max, ERR);
+	d->health = h;
+}
 
-	if (fd < 0) {
-		return die("open /dev/null failed: %s", ERR);
+#define DAEMOND_HEALTH_SYNC 1.0
+
+// master: picks up changes of pools' counters into the status and the log
+static void daemond_health_sync(daemond * d) {
+	daemond_health * h = d->health;
+	daemond_status * st = d->status;
+	int i, running;
+	unsigned restarts;
+	for (i=0; i < d->children_max; i++) {
+		if (!d->children[i])
+			continue;
+		running  = __atomic_load_n(&h[i].running, __ATOMIC_RELAXED);
+		restarts = __atomic_load_n(&h[i].restarts, __ATOMIC_RELAXED);
+		if (running == d->slots[i].threads_running && restarts == d->slots[i].thread_restarts)
+			continue;
+		if (running < h[i].threads || restarts != d->slots[i].thread_restarts)
+			debug_ratelimited(10, 1, "Pool of slot %d: %d of %d threads running, %u restarts", i, running, h[i].threads, restarts);
+		d->slots[i].threads_running = running;
+		d->slots[i].thread_restarts = restarts;
+		if (st) {
+			daemond_status_begin(st);
+			st->slot[i].threads         = h[i].threads;
+			st->slot[i].threads_running = running;
+			st->slot[i].thread_restarts = restarts;
+			daemond_status_end(st);
+		}
 	}
+}
 
-	if (dup2(fd, STDIN_FILENO) == -1) {
-		die("dup2(stdin) failed: %s",ERR);
+#ifdef __linux__
+// "0-3,8,10-11" into a set
+static int daemond_cpulist(const char * path, cpu_set_t * set) {
+	char buf[4096], * p, * end;
+	long from, to;
+	ssize_t got;
+	int fd;
+
+	CPU_ZERO(set);
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+		return -1;
+	got = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (got <= 0)
+		return -1;
+	buf[got] = 0;
+	for (p = buf; *p && *p != '\n'; p = *end ? end + 1 : end) {
+		from = to = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		if (*end == '-')
+			to = strtol(end + 1, &end, 10);
+		for (; from <= to && from < CPU_SETSIZE; from++)
+			CPU_SET(from, set);
+		if (*end != ',')
+			break;
 	}
+	return CPU_COUNT(set) ? 0 : -1;
+}
 
-	if (dup2(fd, STDOUT_FILENO) == -1) {
-		die("dup2(stdout) failed: %s",ERR);
+// pins the calling process to CPUs of the slot's NUMA node, round robin
+static void daemond_numa_pin(int slot) {
+	char path[64];
+	cpu_set_t nodes, cpus;
+	int node, n;
+
+	if (daemond_cpulist("/sys/devices/system/node/online", &nodes) == -1) {
+		ewarn("Can't read NUMA nodes");
+		return;
 	}
+	n = slot % CPU_COUNT(&nodes);
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		if (CPU_ISSET(node, &nodes) && n-- == 0)
+			break;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (daemond_cpulist(path, &cpus) == -1 || sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+		ewarn("Can't pin slot %d to NUMA node %d", slot, node);
+	else
+		debug("Slot %d pinned to NUMA node %d", slot, node);
+}
+#else
+static void daemond_numa_pin(int slot) {
+	warn("NUMA pinning is supported on linux only");
+}
+#endif
 
-	if (dup2(fd, STDERR_FILENO) == -1) {
-		die("dup2(stderr) failed: %s",ERR);
+/*
+ * Master event loop: sleeps up to timeout seconds, -1 - until an event,
+ * wakes on signals and drains captured output of children
+ */
+static void daemond_wait(daemond * d, double timeout) {
+	int i, j, n = 0, r, pending = 0;
+	struct pollfd fds[ ( d->std_capture ? d->children_max * 2 : 0 ) + 5 + DAEMOND_METRICS_CONNS + DAEMOND_LOCK_CONNS ];
+	daemond_std * std[ ( d->std_capture ? d->children_max * 2 : 0 ) + 5 + DAEMOND_METRICS_CONNS + DAEMOND_LOCK_CONNS ];
+	int slot[ ( d->std_capture ? d->children_max * 2 : 0 ) + 5 + DAEMOND_METRICS_CONNS + DAEMOND_LOCK_CONNS ];
+	char buf[64];
+
+	if (d->std_capture) {
+		for (i=0; i < d->children_max; i++) {
+			if (d->slots[i].out.fd > -1 && !d->slots[i].out.blocked) {
+				fds[n].fd = d->slots[i].out.fd; fds[n].events = POLLIN;
+				std[n] = &d->slots[i].out; slot[n++] = i;
+			}
+			if (d->slots[i].err.fd > -1 && !d->slots[i].err.blocked) {
+				fds[n].fd = d->slots[i].err.fd; fds[n].events = POLLIN;
+				std[n] = &d->slots[i].err; slot[n++] = i;
+			}
+			pending += d->slots[i].out.ring_len || d->slots[i].err.ring_len
+				|| d->slots[i].out.blocked || d->slots[i].err.blocked;
+		}
+	}
+	if (pending && !d->std_prefix) {
+		// raw output waits for the destination to take more
+		fds[n].fd = d->std_fd > -1 ? d->std_fd : STDOUT_FILENO; fds[n].events = POLLOUT;
+		std[n] = NULL; slot[n++] = -1;
+		pending = 0;
+	}
+	if (d->lock_fd > -1) {
+		fds[n].fd = d->lock_fd; fds[n].events = POLLIN;
+		std[n] = NULL; slot[n++] = -2;
+	}
+	if (d->threads) {
+		fds[n].fd = ((daemond_threads *)d->threads)->wake[0]; fds[n].events = POLLIN;
+		std[n] = NULL; slot[n++] = -3;
+	}
+	if (_G_sig_wake[0] > -1) {
+		fds[n].fd = _G_sig_wake[0]; fds[n].events = POLLIN;
+		std[n] = NULL; slot[n++] = -4;
+	}
+	if (d->metrics_fd > -1) {
+		fds[n].fd = d->metrics_fd; fds[n].events = POLLIN;
+		std[n] = NULL; slot[n++] = -5;
+	}
+	if (_G_metrics_conns_count) {
+		daemond_metrics_pending(d, -1);
+		if (timeout < 0 || timeout > DAEMOND_METRICS_WAIT)
+			timeout = DAEMOND_METRICS_WAIT;
+	}
+	for (i=0; i < _G_metrics_conns_count; i++) {
+		fds[n].fd = _G_metrics_conns[i].fd; fds[n].events = POLLIN;
+		std[n] = NULL; slot[n++] = -6;
+	}
+	if (_G_lock_conns_count) {
+		daemond_lock_pending(d, -1);
+		if (timeout < 0 || timeout > DAEMOND_LOCK_WAIT)
+			timeout = DAEMOND_LOCK_WAIT;
+	}
+	for (i=0; i < _G_lock_conns_count; i++) {
+		fds[n].fd = _G_lock_conns[i].fd; fds[n].events = POLLIN;
+		std[n] = NULL; slot[n++] = -7;
 	}
 
-	if (fd > STDERR_FILENO) {
-		if (close(fd) == -1) {
-			warn("close(%d) failed: %s", fd, ERR);
+	// rounded up, waking before a deadline would only spin; -1 - no deadline
+	r = poll(fds, n, pending ? 0 : timeout < 0 ? -1 : (int)(timeout * 1000 + 0.999));
+	if (r == -1) {
+		if (errno != EINTR)
+			ewarn("poll failed");
+		return;
+	}
+	for (i=0; i < n && r > 0; i++) {
+		if (fds[i].revents) {
+			r--;
+			if (std[i])
+				daemond_std_drain(d, slot[i], std[i], std[i] == &d->slots[slot[i]].out ? "out" : "err");
+			else if (slot[i] == -1 && d->std_policy == DAEMOND_STD_BLOCK) {
+				for (j=0; j < d->children_max; j++) {
+					if (d->slots[j].out.blocked)
+						daemond_std_passthrough(d, j, &d->slots[j].out, "out");
+					if (d->slots[j].err.blocked)
+						daemond_std_passthrough(d, j, &d->slots[j].err, "err");
+				}
+			}
+			else if (slot[i] == -2)
+				daemond_lock_serve(d);
+			else if (slot[i] == -3)
+				daemond_threads_reap(d);
+			else if (slot[i] == -4)
+				while (read(_G_sig_wake[0], buf, sizeof(buf)) > 0);
+			else if (slot[i] == -5)
+				daemond_metrics_serve(d);
+			else if (slot[i] == -6)
+				daemond_metrics_pending(d, fds[i].fd);
+			else if (slot[i] == -7)
+				daemond_lock_pending(d, fds[i].fd);
 		}
 	}
 
-	/*
-	fclose(stdout);
-	stdout = fdopen( STDOUT_FILENO, "w" );
-	fclose(stderr);
-	stderr = fdopen( STDERR_FILENO, "w" );
-	fclose(stdin);
-	stdin = fdopen( STDIN_FILENO, "r" );
-	*/
+	if (d->std_capture && d->std_policy != DAEMOND_STD_BLOCK) {
+		for (i=0; i < d->children_max; i++) {
+			daemond_std_flush(d, i, &d->slots[i].out, "out", DAEMOND_STD_BUDGET);
+			daemond_std_flush(d, i, &d->slots[i].err, "err", DAEMOND_STD_BUDGET);
+		}
+	}
+	// drops are reported at once, then once a second at most
+	if (d->std_capture && !daemond_timer_pending(&d->std_report)) {
+		for (i=0, j=0; i < d->children_max; i++)
+			j += daemond_std_report(d, i);
+		if (j)
+			daemond_timer_add(d, &d->std_report, 1);
+	}
 }
 
 /*
- * STDIN/ERR functions
+ * Timers
+ *
+ * Level 0 holds timers due within DAEMOND_TIMER_SLOTS ticks, one slot per
+ * tick; every next level has slots DAEMOND_TIMER_SLOTS times wider and is
+ * cascaded a slot at a time into the lower one as the wheel turns
  */
 
-static void nonblock(int fd) {
-	int flags = fcntl(fd, F_GETFL, 0);
-	if (flags == -1){
-		die("fcntl get failed: %s",ERR);
-	}
-	if( fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-		die("fcntl set failed: %s",ERR);
-	}
-	return;
+#define DAEMOND_TIMER_MASK ( DAEMOND_TIMER_SLOTS - 1 )
+#define DAEMOND_TIMER_SPAN(level) ( (uint64_t)1 << ( DAEMOND_TIMER_BITS * (level) ) )
+
+double daemond_time(void) {
+	return htime();
 }
 
-void daemond_log_std_intercept(daemond * d) {
-	int fds[2];
-	int outf,errf;
-	if( pipe(fds) == -1 ) die("Can't create pipe for STDOUT interception: %s",ERR);
-	d->stdout_fd = fds[0];outf = fds[1];
-	if( pipe(fds) == -1 ) die("Can't create pipe for STDOUT interception: %s",ERR);
-	d->stderr_fd = fds[0];errf = fds[1];
-	if (dup2( outf, STDOUT_FILENO ) == -1)
-		die("Can't dup2 piped stdout: %s", ERR);
-	//if (dup2(errf, STDERR_FILENO ) == -1)
-	//	die("Can't dup2 piped stderr: %s", ERR);
-	nonblock(d->stdout_fd);
-	//nonblock(d->stderr_fd);
+static uint64_t daemond_timer_tick(double at) {
+	return (uint64_t)( at / DAEMOND_TIMER_TICK );
 }
 
-#define DAEMOND_LOG_BUF 4096
+static void daemond_timer_place(daemond_wheel * w, daemond_timer * t) {
+	uint64_t expires = t->expires < w->tick ? w->tick : t->expires;
+	int level = 0, i;
+
+	while (level < DAEMOND_TIMER_LEVELS - 1 && expires - w->tick >= DAEMOND_TIMER_SPAN(level + 1))
+		level++;
+	// beyond the top level: parked in its farthest slot, placed again on cascade
+	if (expires - w->tick >= DAEMOND_TIMER_SPAN(DAEMOND_TIMER_LEVELS))
+		expires = w->tick + DAEMOND_TIMER_SPAN(DAEMOND_TIMER_LEVELS) - 1;
+	i = ( expires >> ( DAEMOND_TIMER_BITS * level ) ) & DAEMOND_TIMER_MASK;
+
+	t->bucket = level * DAEMOND_TIMER_SLOTS + i;
+	t->prev   = &w->slot[level][i];
+	t->next   = w->slot[level][i];
+	if (t->next)
+		t->next->prev = &t->next;
+	w->slot[level][i] = t;
+	w->used[level] |= (uint64_t)1 << i;
+}
 
-void daemond_log_std_read(daemond * d) {
-	char buf[DAEMOND_LOG_BUF];
-	bzero(buf,DAEMOND_LOG_BUF);
-	char *p,*end, *nl;
-	ssize_t got, cut;
-	p = end = buf; end += DAEMOND_LOG_BUF-1;
+static void daemond_timer_unlink(daemond_wheel * w, daemond_timer * t) {
+	int level = t->bucket / DAEMOND_TIMER_SLOTS, i = t->bucket % DAEMOND_TIMER_SLOTS;
+	*t->prev = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	// the list may be detached for running, then it is not the slot any more
+	if (w && !w->slot[level][i])
+		w->used[level] &= ~( (uint64_t)1 << i );
+	t->next = NULL;
+	t->prev = NULL;
+}
 
-	fflush(stdout);
-	fflush(stderr);
+void daemond_timer_add(daemond * d, daemond_timer * t, double after) {
+	daemond_wheel * w = &d->timers;
+	double now = htime();
+	if (!w->tick)
+		w->tick = daemond_timer_tick(now);
+	if (t->prev)
+		daemond_timer_unlink(w, t);
+	// rounded up, a timer never fires early
+	t->expires = daemond_timer_tick(now + ( after > 0 ? after : 0 ) + DAEMOND_TIMER_TICK * 0.999);
+	daemond_timer_place(w, t);
+}
 
-	while(1) {
-		got = read(d->stdout_fd, p, end - p);
-		if (got > 0) {
-			//debug("read %d bytes: '%s'",got, buf);
-			p += got;
-			while(p > buf) {
-				if ((nl = strchr(buf, '\n'))) {
-					cut = nl-buf+1;
-					debug("got single string: '%-.*s'", cut,buf);
-					memmove(buf, buf + cut, p - buf + 1);
-					p -= cut;
-				} else {
-					if (p > buf) {
-						debug("left string: '%s'",buf);
-					}
-					break;
-				}
-			}
-		}
-		else if (got == 0) {
-			debug("no more bytes");
+void daemond_timer_del(daemond * d, daemond_timer * t) {
+	if (t->prev)
+		daemond_timer_unlink(&d->timers, t);
+}
+
+// first non-empty slot of a level at or after slot i, offset from i or -1
+static int daemond_timer_scan(uint64_t used, int i) {
+	uint64_t rot;
+	if (!used)
+		return -1;
+	rot = ( used >> i ) | ( i ? used << ( DAEMOND_TIMER_SLOTS - i ) : 0 );
+	return __builtin_ctzll(rot);
+}
+
+// tick of the nearest expiry or cascade, which is never later than the
+// nearest deadline; 0 - nothing armed
+static uint64_t daemond_timer_next_tick(daemond_wheel * w) {
+	uint64_t next = 0, at, span;
+	int level, k;
+	if (( k = daemond_timer_scan(w->used[0], w->tick & DAEMOND_TIMER_MASK) ) > -1)
+		next = w->tick + k;
+	for (level = 1; level < DAEMOND_TIMER_LEVELS; level++) {
+		// first span boundary not run yet; the slot of a span already
+		// entered was cascaded and is due a whole turn later
+		span = ( w->tick + DAEMOND_TIMER_SPAN(level) - 1 ) >> ( DAEMOND_TIMER_BITS * level );
+		if (( k = daemond_timer_scan(w->used[level], span & DAEMOND_TIMER_MASK) ) == -1)
+			continue;
+		at = ( span + k ) << ( DAEMOND_TIMER_BITS * level );
+		if (!next || at < next)
+			next = at;
+	}
+	return next;
+}
+
+// seconds until the master has to run timers, -1 - none armed
+static double daemond_timer_next(daemond * d) {
+	uint64_t next = daemond_timer_next_tick(&d->timers);
+	double left;
+	if (!next)
+		return -1;
+	left = next * DAEMOND_TIMER_TICK - htime();
+	return left > 0 ? left : 0;
+}
+
+static void daemond_timer_cascade(daemond_wheel * w, int level, int i) {
+	daemond_timer * t;
+	while (( t = w->slot[level][i] )) {
+		daemond_timer_unlink(w, t);
+		daemond_timer_place(w, t);
+	}
+}
+
+// fires everything due by now, callbacks may add and delete timers
+static void daemond_timer_run(daemond * d) {
+	daemond_wheel * w = &d->timers;
+	uint64_t now = daemond_timer_tick(htime()), next;
+	daemond_timer * list, * t;
+	int level, i;
+
+	while (w->tick && w->tick <= now) {
+		// ticks with nothing to fire or cascade are skipped at once
+		next = daemond_timer_next_tick(w);
+		if (!next || next > now) {
+			w->tick = now + 1;
 			break;
 		}
-		else {
-			switch(errno) {
-				case EAGAIN: // no more data;
-					return;
-				case EINTR: // try again now
-					break;
-				default:
-					die("read failed: %s",ERR);
-			}
+		w->tick = next;
+		for (level = 1; level < DAEMOND_TIMER_LEVELS; level++) {
+			if (w->tick & ( DAEMOND_TIMER_SPAN(level) - 1 ))
+				break;
+			daemond_timer_cascade(w, level, ( w->tick >> ( DAEMOND_TIMER_BITS * level ) ) & DAEMOND_TIMER_MASK);
+		}
+		i = w->tick & DAEMOND_TIMER_MASK;
+		list = w->slot[0][i];
+		w->slot[0][i] = NULL;
+		w->used[0] &= ~( (uint64_t)1 << i );
+		if (list)
+			list->prev = &list;
+		w->tick++;
+		while (( t = list )) {
+			daemond_timer_unlink(NULL, t);
+			if (t->cb)
+				t->cb(d, t);
 		}
 	}
-	return;
 }
 
+/*
+ * Lifecycle hooks
+ */
+
+static struct {
+	daemond_hook      hook;
+	void            * arg;
+} _G_hooks[DAEMOND_HOOKS][DAEMOND_HOOKS_MAX];
+static int _G_hooks_count[DAEMOND_HOOKS];
+
+int daemond_hook_add(daemond_hook_event event, daemond_hook hook, void * arg) {
+	if (event < 0 || event >= DAEMOND_HOOKS || !hook) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (_G_hooks_count[event] == DAEMOND_HOOKS_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+	_G_hooks[event][_G_hooks_count[event]].hook = hook;
+	_G_hooks[event][_G_hooks_count[event]++].arg = arg;
+	return 0;
+}
+
+int daemond_hook_del(daemond_hook_event event, daemond_hook hook, void * arg) {
+	int i;
+	if (event < 0 || event >= DAEMOND_HOOKS) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i=0; i < _G_hooks_count[event]; i++) {
+		if (_G_hooks[event][i].hook == hook && _G_hooks[event][i].arg == arg) {
+			memmove(&_G_hooks[event][i], &_G_hooks[event][i + 1], ( --_G_hooks_count[event] - i ) * sizeof(_G_hooks[event][0]));
+			return 0;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+static void daemond_hook_call(daemond * d, daemond_event * ev) {
+	int i;
+	for (i=0; i < _G_hooks_count[ev->event]; i++)
+		_G_hooks[ev->event][i].hook(d, ev, _G_hooks[ev->event][i].arg);
+}
+
+// the event is only built if someone listens
+#define daemond_hook_fire(d, e, ...) do { \
+		if (_G_hooks_count[e]) { \
+			daemond_event _ev = { .event = e, __VA_ARGS__ }; \
+			daemond_hook_call(d, &_ev); \
+		} \
+	} while (0)
+
 /*
  * Main functions
  */
@@ -911,25 +4977,40 @@ void daemond_init(daemond * d) {
 	bzero(d,sizeof(*d));
 
 	d->use_pid          = 1;
+	d->stop_int         = 1;   // double seconds
+	d->stop_term        = 1;   // double seconds
+	d->stop_kill        = 1;   // double seconds
+	d->lock_fd          = -1;
+	d->metrics_fd       = -1;
+	d->slot             = -1;
 	d->children_count   = 1;
 	d->max_die          = 3;   // max die before raising restart interval
 	d->min_restart_interval =  // double seconds
 	d->restart_interval = 0.1; // double seconds
 	d->max_restart_interval = 30; // double seconds
+	d->std_pipe_size    = 1 << 20; // bytes, default pipe-max-size on linux
+	d->std_prefix       = 1;
+	d->std_fd           = -1;
+	d->std_policy       = DAEMOND_STD_BLOCK;
+	d->std_overflow     = 1 << 20; // bytes per stream of every slot
+	d->log_buffer       = 64 * 1024;
+	d->log_flush_interval = 1;   // double seconds
+	d->log_fsync_interval = 0;   // double seconds, 0 - never
+	d->log_worker_buffer  = 0;
 
 	d->cli.d = d;
 	d->pid.d = d;
 }
 
-void daemond_sig_child_sihandler(int sig, struct __siginfo *info, void *uap) {
+void daemond_sig_child_sihandler(int sig, siginfo_t *info, void *uap) {
 	//debug("Signal %d received", sig);
-	debug("Received signal %d (%s), ignoring", sig, sys_signame[sig]);
+	debug("Received signal %d (%s), ignoring", sig, signame(sig));
 	return;
 }
 
 void daemond_sig_child_handler(int sig) {
 	//debug("Signal %d received", sig);
-	debug("Received signal %d (%s), ignoring", sig, sys_signame[sig]);
+	debug("Received signal %d (%s), ignoring", sig, signame(sig));
 	return;
 }
 
@@ -982,76 +5063,143 @@ static void daemond_spawned(daemond * d) {
 // should return 1 on master, 0 on child
 int daemond_fork(daemond * d, int slot) {
 	pid_t pid;
+	int out[2], err[2];
 	//char *argv[] = { "echo", "echo", "ok", 0 };
 
+	if (d->std_capture) {
+		daemond_std_close(d, slot);
+		daemond_std_pipe(d, out);
+		daemond_std_pipe(d, err);
+	}
+	if (d->flight) {
+		daemond_flight_ring_of(d, slot)->head = 0;
+	}
+	if (d->health) {
+		((daemond_health *)d->health)[slot] = (daemond_health){ d->threads_per_child, 0, 0, 0 };
+		d->slots[slot].threads_running = 0;
+		d->slots[slot].thread_restarts = 0;
+	}
+
+	daemond_hook_fire(d, DAEMOND_HOOK_PRE_FORK, .slot = slot);
 	switch (pid = fork()) {
 		case -1:
 			die("fork failed: %s", ERR);
 			return 1;
 		case 0:  // forked child
+			d->slot = slot;
+			daemond_sig_wake_close();
+			daemond_metrics_close(d);
+			daemond_lock_close(d);
+			if (d->flight)
+				_G_flight = daemond_flight_ring_of(d, slot);
+			if (d->numa_pin)
+				daemond_numa_pin(slot);
 			daemond_spawned(d);
+			if (d->std_capture) {
+				close(out[0]);
+				close(err[0]);
+				daemond_std_attach(d, out[1], err[1]);
+			}
+			daemond_hook_fire(d, DAEMOND_HOOK_CHILD, .slot = slot, .pid = getpid());
 			return 0;
 		default: // master process
 			d->children[slot] = pid;
 			d->children_running++;
+			daemond_metric_add(forks, 1);
+			if (d->slots[slot].died_at > 0) {
+				daemond_metric_restart(htime() - d->slots[slot].died_at);
+				d->slots[slot].died_at = 0;
+			}
+			daemond_status_slot_set(d, slot, pid, DAEMOND_STATE_RUNNING, 0);
+			if (d->std_capture) {
+				close(out[1]);
+				close(err[1]);
+				nonblock(out[0]);
+				nonblock(err[0]);
+				d->slots[slot].pid    = pid;
+				d->slots[slot].out.fd = out[0];
+				d->slots[slot].err.fd = err[0];
+			}
+			daemond_hook_fire(d, DAEMOND_HOOK_FORKED, .slot = slot, .pid = pid);
 			return 1;
 	}
 }
 
 // should return 1 on master, 0 on child
 static int daemond_check_children(daemond * d) {
-	int i, do_fork = 0, running = 0;
+	static daemond_ratelimit gone_rl;
+	int i, do_fork, running = 0;
 	pid_t pid;
-	for ( i=0; i < d->children_count; i++ ) {
+	for ( i=0; i < d->children_max; i++ ) {
+		do_fork = 0;
 		if (( pid = d->children[i] )) {
 			if ( kill(pid,0) == 0 ) {
 				// ok
 				//daemond_say(d,"<g>pid %d (slot %d) is alive",pid, i); //too often
 				running++;
 			} else {
-				daemond_say(d,"<r>no more child for slot %d with pid %d (%s)",i,pid, ERR);
+				if (daemond_ratelimit_pass(&gone_rl, 10, 1))
+					daemond_say(d,"<r>no more child for slot %d with pid %d (%s)",i,pid, ERR);
 				d->children[i] = 0;
 				do_fork = 1;
 			}
 		} else {
 			do_fork = 1;
 		}
-		if (do_fork) {
-			if (htime() > d->fork_at) {
+		// slots over children_count are left by scale down or drain, not refilled
+		if (do_fork && i < d->children_count && !d->draining) {
+			if (!daemond_timer_pending(&d->respawn)) {
 				if( !daemond_fork(d,i) ) {
 					return 0;
 				}
+				running++;
 			}
 		}
 	}
-	d->children_running = running;
+	if (d->children_running != running) {
+		d->children_running = running;
+		daemond_status_master_set(d, DAEMOND_STATE_RUNNING);
+	}
 	return 1;
 }
 
 
 static void daemond_reaper(daemond * d) {
 	pid_t pid;
-	int status, exitcode, signal, core, died = 0;
+	int status, exitcode, signal, core, died = 0, dead, slot;
 			while( ( pid = waitpid(-1,&status,WNOHANG) )  > 0) {
+				dead = 0;
 				d->children_running--;
+				slot = daemond_slot_of(d, pid);
+				daemond_status_slot_set(d, slot, 0, DAEMOND_STATE_EXITED, status);
 				exitcode = status >> 8;
 				signal =  status & 127;
 				core = status & 128;
-				//debug("Reaping %d (status=%d, exit=%d, sig='%s', core=%d)", pid, status, exitcode, sys_signame[ signal ], core );
+				// slots left by scale down or shutdown are not restarted
+				if (slot > -1 && slot < d->children_count && !d->draining && !d->terminate)
+					d->slots[slot].died_at = htime();
+				//debug("Reaping %d (status=%d, exit=%d, sig='%s', core=%d)", pid, status, exitcode, signame( signal ), core );
 				if (exitcode != 0) {
-					debug("Child %d died with exitcode %d (%s); signal=%s, core=%d", pid, exitcode, strerror(exitcode), sys_signame[ signal ], core );
-					died = 1;
+					debug_ratelimited(10, 1, "Child %d died with exitcode %d (%s); signal=%s, core=%d", pid, exitcode, strerror(exitcode), signame( signal ), core );
+					died = dead = 1;
+					daemond_metric_add(failed_exits, 1);
+					if (d->flight && slot > -1)
+						daemond_flight_dump(d, slot, pid);
 				} else
 				if (signal || core) {
 					if (signal == SIGTERM || signal == SIGQUIT || signal == SIGINT) {
-						debug("Child %d correctly exited with signal=%s, core=%d", pid, sys_signame[ signal ], core );
+						debug_ratelimited(10, 1, "Child %d correctly exited with signal=%s, core=%d", pid, signame( signal ), core );
 					} else {
-						debug("Child %d died with signal=%s, core=%d", pid, sys_signame[ signal ], core );
-						died = 1;
+						debug_ratelimited(10, 1, "Child %d died with signal=%s, core=%d", pid, signame( signal ), core );
+						died = dead = 1;
+						if (signal < NSIG)
+							daemond_metric_add(deaths[signal], 1);
+						if (d->flight && slot > -1)
+							daemond_flight_dump(d, slot, pid);
 					}
 				}
 				else {
-					debug("Child %d normally gone",pid);
+					debug_ratelimited(10, 1, "Child %d normally gone",pid);
 					/*
 					if ( kill( pid, 0 ) == 0 ) {
 						debug("Pid is alive");
@@ -1060,30 +5208,40 @@ static void daemond_reaper(daemond * d) {
 					}
 					*/
 				}
+				daemond_hook_fire(d, DAEMOND_HOOK_REAPED, .slot = slot, .pid = pid, .status = status,
+					.exitcode = exitcode, .termsig = signal, .core = core != 0, .died = dead);
 			}
-			if (died) {
-				d->die_count++;
-				d->last_die_count++;
-				if (d->max_die > 0 && ( d->last_die_count + 1 > d->max_die * d->children_count )) {
-					d->restart_interval *= 2;
-					if (d->restart_interval > d->max_restart_interval)
-						d->restart_interval = d->max_restart_interval;
-					debug( "Children repeatedly died %d times, restart interval=%0.2fs", d->die_count, d->restart_interval );
-					d->fork_at = htime() + ( d->restart_interval *= 2 );
-					d->last_die_count = 0;
-					//d->terminate = 1;
-				} else {
-					d->fork_at = htime() + d->restart_interval;
-				}
-			} else {
-				d->last_die_count = d->die_count = 0;
-				d->fork_at = htime();
-			}
+			daemond_respawn_backoff(d, died);
+
+}
 
+// spaces respawns out, the more workers die in a row the longer
+static void daemond_respawn_backoff(daemond * d, int died) {
+	if (died) {
+		d->die_count++;
+		d->last_die_count++;
+		if (d->max_die > 0 && ( d->last_die_count + 1 > d->max_die * d->children_count )) {
+			d->restart_interval *= 2;
+			if (d->restart_interval > d->max_restart_interval)
+				d->restart_interval = d->max_restart_interval;
+			debug( "Children repeatedly died %d times, restart interval=%0.2fs", d->die_count, d->restart_interval );
+			daemond_timer_add(d, &d->respawn, d->restart_interval *= 2);
+			daemond_hook_fire(d, DAEMOND_HOOK_RESPAWN, .slot = -1, .after = d->restart_interval);
+			d->last_die_count = 0;
+			//d->terminate = 1;
+		} else {
+			daemond_timer_add(d, &d->respawn, d->restart_interval);
+			daemond_hook_fire(d, DAEMOND_HOOK_RESPAWN, .slot = -1, .after = d->restart_interval);
+		}
+	} else {
+		d->last_die_count = d->die_count = 0;
+		daemond_timer_del(d, &d->respawn);
+	}
 }
 
 
 static void daemond_sig_safe_handler(daemond * d, int sig) {
+	int i;
 	switch(sig) {
 		case SIGQUIT:
 		case SIGINT:
@@ -1095,9 +5253,20 @@ static void daemond_sig_safe_handler(daemond * d, int sig) {
 			d->terminate = 2;
 			return;
 		case SIGCHLD:
-			debug("Handle sigchld");
+			debug_ratelimited(10, 1, "Handle sigchld");
 			daemond_reaper(d);
 			return;
+		case SIGUSR1:
+			if (_G_logfile.fd > -1) {
+				debug("Handle sigusr1, reopen log file");
+				if (daemond_log_file_reopen() == -1)
+					ewarn("Can't reopen log file `%s'", _G_logfile.path);
+				for ( i=0; i < d->children_max; i++ ) {
+					if (d->children[i])
+						kill(d->children[i], SIGUSR1);
+				}
+			}
+			return;
 		default:
 			debug("Signal %d received", sig);
 			break;
@@ -1108,31 +5277,32 @@ static void daemond_sig_safe_handler(daemond * d, int sig) {
 static void daemond_sig_check(daemond * d) {
 	//pid_t pid;
 	int sig;
-		if(daemond_sig_was_received) {
+		// taken by exchange: a signal landing meanwhile is not lost
+		if (__atomic_exchange_n(&daemond_sig_was_received, 0, __ATOMIC_ACQ_REL)) {
 			for (sig=0; sig < NSIG; sig++) {
-				if (daemond_sig_received[sig]) {
-					daemond_sig_received[sig] = 0;
+				if (__atomic_exchange_n(&daemond_sig_received[sig], 0, __ATOMIC_ACQ_REL)) {
+					daemond_metric_add(signals[sig], 1);
+					daemond_hook_fire(d, DAEMOND_HOOK_SIGNAL, .slot = -1, .signo = sig);
 					daemond_sig_safe_handler(d, sig);
 				}
 			}
-			daemond_sig_was_received = 0;
 		}
 
 }
 
-void daemond_master(daemond * d) {
-	pid_t pid, children[ 10 ];
-	int i;//, sig
-
-	bzero( children, sizeof(children) );
-	d->children = children;
-	d->children_running = 0;
-	d->fork_at  = htime();
-
-	d->force_quit       = 1;
-
-	daemond_sig_init(d);
+// the nearest flush of log sinks, worker threads log while master sleeps
+static void daemond_flush_arm(daemond * d) {
+	double file = daemond_log_file_due(d->threads != NULL), sys = daemond_syslog_due(d->threads != NULL);
+	if (file < 0 || ( sys > -1 && sys < file ))
+		file = sys;
+	if (file > -1)
+		daemond_timer_add(d, &d->flush, file);
+	else
+		daemond_timer_del(d, &d->flush);
+}
 
+// runs workers until terminated or drained, returns 0 in a forked worker
+static int daemond_supervise(daemond * d) {
 	while(1) {
 		//daemond_say(d,"xxx"); //too often
 		daemond_sig_check(d);
@@ -1145,16 +5315,45 @@ void daemond_master(daemond * d) {
 			so, 0 is a child, 1 is a master
 		*/
 
-		if ( ! daemond_check_children(d) ) {
-			return;
+		if (d->threads)
+			daemond_check_threads(d);
+		else if ( ! daemond_check_children(d) ) {
+			return 0;
 		}
-		//usleep(100000);
-		usleep(1000000);
+		if (d->draining && !d->children_running) {
+			debug("Drained");
+			break;
+		}
+		if (d->health && d->slot < 0) {
+			daemond_health_sync(d);
+			if (!daemond_timer_pending(&d->health_sync))
+				daemond_timer_add(d, &d->health_sync, DAEMOND_HEALTH_SYNC);
+		}
+		daemond_log_file_tick();
+		daemond_syslog_tick();
+		daemond_flush_arm(d);
+		// sleeps until the nearest deadline, every wakeup is armed on the wheel
+		daemond_wait(d, daemond_timer_next(d));
+		daemond_timer_run(d);
 	}
+	return 1;
+}
+
+#define DAEMOND_STOP_WAIT 5.0
+
+static void daemond_stop_workers(daemond * d) {
+	double at, left;
+	pid_t pid;
+	int i;
+
 	if (d->children_running) {
 		debug("Terminating %d children",d->children_running);
-		for ( i=0; i < d->children_count; i++ ) {
-			if (( pid = d->children[i] )) {
+		for ( i=0; i < d->children_max; i++ ) {
+			if (d->threads) {
+				if (daemond_slot_stop(d, i) == -1)
+					debug("stop of thread %d failed: %s", i, ERR);
+			}
+			else if (( pid = d->children[i] )) {
 				if(kill(pid, SIGTERM) == -1) {
 					debug("kill TERM %d failed: %s", pid,ERR);
 				} else {
@@ -1162,14 +5361,20 @@ void daemond_master(daemond * d) {
 				}
 			}
 		}
-		for (i=0;i<100;i++) {
+		// exits wake the loop, nothing to poll for
+		at = htime() + DAEMOND_STOP_WAIT;
+		while (1) {
 			daemond_sig_check(d);
-			if (d->children_running == 0)
+			if (d->children_running == 0 || ( left = at - htime() ) <= 0)
 				break;
-			usleep( 50000 );
+			daemond_wait(d, left);
+		}
+		// threads can't be killed, exit() takes them
+		if (d->children_running && d->threads) {
+			warn("%d threads did not stop", d->children_running);
 		}
-		if (d->children_running) {
-			for ( i=0; i < d->children_count; i++ ) {
+		else if (d->children_running) {
+			for ( i=0; i < d->children_max; i++ ) {
 				if (( pid = d->children[i] )) {
 					if(kill(pid, SIGKILL) == -1) {
 						debug("kill KILL %d failed: %s", pid,ERR);
@@ -1180,13 +5385,106 @@ void daemond_master(daemond * d) {
 			}
 		}
 	}
+}
+
+// hybrid: forked worker becomes master of its own pool of worker threads
+static void daemond_pool(daemond * d) {
+	daemond_sig_t ignore_int = { SIGINT, "SIGINT", 0, "", SIG_IGN, NULL };
+	int i;
+
+	d->children_count   = d->children_max = d->threads_per_child;
+	d->children         = calloc( d->children_max, sizeof(pid_t) );
+	d->slots            = calloc( d->children_max, sizeof(daemond_slot) );
+	if (!d->children || !d->slots)
+		die("Can't allocate pool of %d threads: %s", d->children_max, ERR);
+	for ( i=0; i < d->children_max; i++ )
+		d->slots[i].out.fd = d->slots[i].err.fd = -1;
+	// whatever belongs to master stays there
+	d->std_capture      = 0;
+	d->status           = NULL;
+	d->flight           = NULL;
+	d->control          = 0;
+	d->draining         = 0;
+	d->children_running = 0;
+	d->die_count        = d->last_die_count = 0;
+	d->restart_interval = d->min_restart_interval;
+	bzero(&d->timers, sizeof(d->timers));
+	bzero(&d->respawn, sizeof(d->respawn));
+	bzero(&d->flush, sizeof(d->flush));
+	bzero(&d->health_sync, sizeof(d->health_sync));
+	bzero(&d->std_report, sizeof(d->std_report));
+	bzero(_G_hooks_count, sizeof(_G_hooks_count)); // master's listeners
+
+	daemond_threads_init(d);
+	daemond_sig_init(d);
+	daemond_sig_set(d, &ignore_int); // as in any worker, INT is master's
+	daemond_supervise(d);
+	daemond_stop_workers(d);
+	exit(0);
+}
+
+void daemond_master(daemond * d) {
+	int i;
+
+	if (d->children_max < d->children_count)
+		d->children_max = d->children_count;
+	d->children = calloc( d->children_max, sizeof(pid_t) );
+	d->slots    = calloc( d->children_max, sizeof(daemond_slot) );
+	if (!d->children || !d->slots)
+		die("Can't allocate %d children slots: %s", d->children_max, ERR);
+	for ( i=0; i < d->children_max; i++ ) {
+		d->slots[i].out.fd = d->slots[i].err.fd = -1;
+		if (d->std_capture && d->std_overflow < DAEMOND_LOG_BUF)
+			d->std_overflow = DAEMOND_LOG_BUF;
+		if (d->std_capture && d->std_policy != DAEMOND_STD_BLOCK) {
+			if (!( d->slots[i].out.ring = malloc(d->std_overflow) ) || !( d->slots[i].err.ring = malloc(d->std_overflow) ))
+				die("Can't allocate %zu bytes of capture overflow: %s", d->std_overflow, ERR);
+		}
+	}
+	if (d->worker && d->threads_per_child > 0)
+		daemond_health_init(d);
+	else if (d->worker)
+		daemond_threads_init(d);
+	if (!d->threads && d->flight_records > 0)
+		daemond_flight_init(d);
+	d->children_running = 0;
+	if (d->status_file)
+		daemond_status_init(d);
+	if (d->control && d->lock_fd == -1 && !daemond_lock_socket(d))
+		warn("Control socket of `%s' is held by another process", d->name);
+	if (d->metrics_listen && d->metrics_fd == -1 && daemond_metrics_listen(d) == -1)
+		ewarn("Can't serve metrics on `%s'", d->metrics_listen);
+	d->force_quit       = 1;
+
+	daemond_sig_init(d);
+
+	if (!daemond_supervise(d)) {
+		if (d->health)
+			daemond_pool(d);
+		if (!d->log_worker_buffer)
+			daemond_log_file_unbuffer();
+		return;
+	}
+	daemond_status_master_set(d, DAEMOND_STATE_STOPPING);
+	daemond_stop_workers(d);
 	/*
-	for ( i=0; i < d->children_count; i++ ) {
+	for ( i=0; i < d->children_max; i++ ) {
 		if ( pid = d->children[i] ) {
 		}
 	}
 	*/
 
+	if (d->std_capture) {
+		for ( i=0; i < d->children_max; i++ ) {
+			daemond_std_close(d, i);
+		}
+	}
+
+	if (d->metrics_fd > -1 && d->metrics_listen[0] == '/')
+		unlink(d->metrics_listen);
+	daemond_metrics_close(d);
+	daemond_status_master_set(d, DAEMOND_STATE_STOPPED);
+	daemond_hook_fire(d, DAEMOND_HOOK_SHUTDOWN, .slot = -1);
 	daemond_say(d,"<y>terminating master");
 	exit(0);
 }
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <signal.h>
+#include <stdint.h>
 
 struct _daemond; // global container
 
@@ -16,6 +17,9 @@ typedef struct {
 	int               fd;
 	FILE            * handle;
 	int               verbose;
+	int               ofd;      // lock with F_OFD_SETLK, pread/pwrite without stdio
+	int               durable;  // ofd: fdatasync after every write
+	off_t             size;     // ofd: file size, to cut a longer stale pid
 } daemond_pid;
 
 typedef struct {
@@ -23,17 +27,125 @@ typedef struct {
 
 } daemond_cli;
 
+#define DAEMOND_LOG_BUF 4096
+
+typedef enum {
+	DAEMOND_STD_BLOCK,       // worker waits in write() until master drains
+	DAEMOND_STD_DROP_NEWEST, // master buffers, then discards incoming bytes
+	DAEMOND_STD_DROP_OLDEST, // master buffers, then discards oldest buffered bytes
+} daemond_std_policy;
+
+typedef struct {
+	int               fd;      // master's read end, -1 if closed
+	size_t            len;     // bytes of incomplete line kept in buf
+	char              buf[DAEMOND_LOG_BUF];
+	char            * ring;    // overflow buffer of drop policies, std_overflow bytes,
+	                           // or unframed bytes the destination didn't take yet
+	size_t            ring_off;
+	size_t            ring_len;
+	size_t            dropped;          // bytes dropped since the slot was created
+	size_t            dropped_reported; // part of them already told about
+	int               blocked; // unframed output waits for the destination to take more
+} daemond_std;
+
+typedef struct {
+	pid_t             pid;     // owner of the captured output
+	daemond_std       out;
+	daemond_std       err;
+	int               threads_running; // hybrid: last seen health of the pool
+	unsigned          thread_restarts;
+	double            died_at; // last worker's exit to be restarted, 0 - none
+} daemond_slot;
+
+/*
+ * Status file layout, all fields are native endian. Master rewrites it in
+ * place, seq is odd while it does, readers retry until seq is even and
+ * unchanged over their copy
+ */
+
+#define DAEMOND_STATUS_MAGIC   0x5344444dU // "MDDS"
+#define DAEMOND_STATUS_VERSION 2
+
+enum {
+	DAEMOND_STATE_NONE,     // slot never forked, master not started
+	DAEMOND_STATE_RUNNING,
+	DAEMOND_STATE_EXITED,   // worker reaped, waiting for restart
+	DAEMOND_STATE_STOPPING, // master terminates
+	DAEMOND_STATE_STOPPED,  // master exited cleanly
+};
+
+typedef struct {
+	int64_t           pid;
+	int64_t           started;     // unix time of the fork
+	uint64_t          forks;       // how many times the slot was forked
+	int32_t           state;
+	int32_t           status;      // wait status of the last reaped worker
+	int32_t           threads;     // hybrid: pool size of the worker, 0 - not a pool
+	int32_t           threads_running;
+	uint64_t          thread_restarts; // by the current worker
+} daemond_status_slot;
+
+typedef struct {
+	uint32_t          magic;
+	uint32_t          version;
+	uint32_t          seq;
+	uint32_t          slots;
+	int64_t           pid;         // master
+	int64_t           started;     // unix time master started
+	uint64_t          start_ticks; // master's start since boot (linux), tells pid reuse
+	uint64_t          generation;  // bumped on every change
+	int32_t           state;
+	int32_t           running;
+	daemond_status_slot slot[];
+} daemond_status;
+
+/*
+ * Master's deadlines on CLOCK_MONOTONIC, hashed into a hierarchical wheel:
+ * arming, cancelling and expiry cost O(1) whatever the number of timers
+ */
+#define DAEMOND_TIMER_TICK   0.005 // seconds, resolution of the wheel
+#define DAEMOND_TIMER_BITS   6
+#define DAEMOND_TIMER_SLOTS  ( 1 << DAEMOND_TIMER_BITS )
+#define DAEMOND_TIMER_LEVELS 4     // spans 0.32s, 20s, 22m, 23h; longer ones cascade again
+
+typedef struct _daemond_timer daemond_timer;
+typedef void (*daemond_timer_cb)(struct _daemond * d, daemond_timer * t);
+
+struct _daemond_timer {
+	daemond_timer   * next;
+	daemond_timer  ** prev;    // NULL while not armed
+	uint64_t          expires; // tick
+	int               bucket;  // level * DAEMOND_TIMER_SLOTS + slot
+	daemond_timer_cb  cb;      // may be NULL, expiry only disarms then
+	void            * data;
+};
+
+typedef struct {
+	uint64_t          tick;    // next one to run, 0 - not started
+	uint64_t          used[DAEMOND_TIMER_LEVELS]; // bitmaps of non-empty slots
+	daemond_timer   * slot[DAEMOND_TIMER_LEVELS][DAEMOND_TIMER_SLOTS];
+} daemond_wheel;
+
+// body of a thread worker: 0 when its job is done, anything else to be restarted
+typedef int (*daemond_worker)(struct _daemond * d, int slot, void * arg);
+
 struct _daemond {
 	const char      * name;
 	int               use_pid;
+	int               use_socket;    // instance lock by abstract unix socket, linux
+	int               control;       // master serves commands on that socket anyway
+	int               lock_fd;       // listening instance socket, -1 if not held
 	int               force_quit;
+	double            stop_int;      // CLI stop waits that long after INT,
+	double            stop_term;     // then TERM,
+	double            stop_kill;     // then KILL to the group
 	int               detach;
 	int               detached;
 
 	int               die_count;
 	int               last_die_count;
 	int               max_die;
-	double            fork_at;
+	daemond_timer     respawn;       // armed while forks wait out restart_interval
 	double            min_restart_interval;
 	double            restart_interval;
 	double            max_restart_interval;
@@ -44,9 +156,45 @@ struct _daemond {
 	int               stdout_fd;
 	int               stderr_fd;
 
+	int               std_capture;   // per slot stdout/stderr pipes, drained by master
+	int               std_pipe_size; // F_SETPIPE_SZ for capture pipes, 0 - system default
+	int               std_prefix;    // frame captured lines with slot, pid and stream
+	int               std_fd;        // where unframed output goes, -1 - master's stdout
+	int               std_policy;    // daemond_std_policy for a worker outpacing master
+	size_t            std_overflow;  // per stream buffer of drop policies, bytes
+
+	const char      * log_file;           // tracers write here once detached
+	size_t            log_buffer;         // batch buffer, 0 - write each line
+	double            log_flush_interval; // max age of a buffered line
+	double            log_fsync_interval; // fdatasync period, 0 - never
+	int               log_worker_buffer;  // workers batch too, a line then waits for the next one
+
 	int               children_count;
+	int               children_max;  // slots allocated, limit of scale, 0 - children_count
+	daemond_worker    worker;        // workers are threads of master running it, not forks
+	void            * worker_arg;
+	void            * threads;       // thread workers state
+	int               threads_per_child; // hybrid: every forked worker runs a pool of worker threads
+	int               numa_pin;      // forked workers are pinned to NUMA nodes round robin, linux
+	void            * health;        // hybrid: pools' thread counters shared with master
 	int               children_running;
+	int               draining;      // no respawns, master exits with the last worker
+	int               slot;          // worker's slot, -1 in master
+
+	const char      * metrics_listen; // Prometheus endpoint: "[host:]port", "/path" or "@abstract", NULL - none
+	int               metrics_fd;
+
+	const char      * status_file;   // mmap'd daemond_status kept by master, NULL - none
+	daemond_status  * status;
+
+	int               flight_records; // per slot flight recorder depth, 0 - off
+	void            * flight;
 	pid_t           * children;
+	daemond_slot    * slots;
+	daemond_wheel     timers;
+	daemond_timer     flush;         // wakes master when buffered log lines are due
+	daemond_timer     health_sync;   // wakes master to pick up counters of pools
+	daemond_timer     std_report;    // armed while the next report of drops waits
 
 	int               terminate;
 };
@@ -55,16 +203,127 @@ typedef struct _daemond daemond;
 
 typedef enum { START,CHECK,STOP,RESTART,EXTENDED } daemond_cli_com;
 
+/*
+ * Timer functions, master's loop runs them
+ */
+double daemond_time(void); // CLOCK_MONOTONIC seconds
+void   daemond_timer_add(daemond * d, daemond_timer * t, double after);
+void   daemond_timer_del(daemond * d, daemond_timer * t);
+#define daemond_timer_pending(t) ( (t)->prev != NULL )
+
 
 /*
  * Speech functions
  */
 typedef void (*tracer_t)(const char * fmt, va_list va_args);
 
+/*
+ * Log levels. Records below daemond_log_threshold are skipped before their
+ * arguments are evaluated, records below DAEMOND_LOG_FLOOR (set at compile
+ * time, INFO in Release builds) are not compiled in at all
+ */
+#define DAEMOND_LOG_DEBUG  0
+#define DAEMOND_LOG_INFO   1
+#define DAEMOND_LOG_NOTICE 2
+#define DAEMOND_LOG_WARN   3
+#define DAEMOND_LOG_ERR    4
+
+#ifndef DAEMOND_LOG_FLOOR
+#define DAEMOND_LOG_FLOOR  DAEMOND_LOG_DEBUG
+#endif
+
+extern int daemond_log_threshold;
+
+#define daemond_log_enabled(level) ( (level) >= DAEMOND_LOG_FLOOR && (level) >= daemond_log_threshold )
+
+typedef struct {
+	double            start;
+	int               count;
+	int               suppressed;
+} daemond_ratelimit;
+
+void   daemond_set_log_level(int level);
+int    daemond_ratelimit_pass(daemond_ratelimit * rl, int burst, double interval);
+
 void   daemond_set_tracer(const tracer_t);
 void   daemond_set_tracer_debug(const tracer_t);
+void   daemond_set_colors(int mode); // -1 - if stdout is a terminal (default), 0 - never, 1 - always
 
 void   daemond_say(daemond * d, const char * fmt, ...);
+void   daemond_log(daemond * d, int level, const char * fmt, ...);
+
+// daemond_log() with arguments evaluated only if level is enabled
+#define daemond_say_level(d, level, fmt, ...) do { \
+		if (daemond_log_enabled(level)) daemond_log(d, level, fmt, ##__VA_ARGS__); \
+	} while (0)
+
+// at most burst records per interval seconds from this call site
+#define daemond_say_ratelimited(d, level, burst, interval, fmt, ...) do { \
+		static daemond_ratelimit _rl; \
+		if (daemond_log_enabled(level) && daemond_ratelimit_pass(&_rl, burst, interval)) \
+			daemond_log(d, level, fmt, ##__VA_ARGS__); \
+	} while (0)
+
+/*
+ * Asynchronous tracer: lines are queued and written by a dedicated thread,
+ * a daemond_say() record takes one queue cell with its prefix and newline.
+ * Start it, then pass daemond_async_tracer to daemond_set_tracer*
+ */
+typedef enum { DAEMOND_ASYNC_BLOCK, DAEMOND_ASYNC_DROP } daemond_async_policy;
+
+int    daemond_async_start(int fd, size_t depth, daemond_async_policy policy);
+void   daemond_async_stop(void);
+void   daemond_async_tracer(const char * fmt, va_list va_args);
+unsigned long daemond_async_dropped(void);
+
+/*
+ * Record tracer: daemond_say() hands it the whole record, which is formatted
+ * into a thread local buffer and written by one write(2), so lines up to
+ * PIPE_BUF do not interleave between threads and workers sharing the fd
+ */
+void   daemond_record_set_fd(int fd);
+void   daemond_record_tracer(const char * fmt, va_list va_args);
+
+/*
+ * Binary tracer: stores format pointer and raw arguments into a per thread
+ * ring without formatting. daemond_binlog_dump() saves the rings,
+ * daemond_binlog_decode() (or ex/binlog) turns a dump into text
+ */
+void   daemond_binlog_set_ring_size(size_t size);
+void   daemond_binlog_tracer(const char * fmt, va_list va_args);
+int    daemond_binlog_dump(int fd);
+int    daemond_binlog_decode(int fd, FILE * out, int colors);
+
+/*
+ * Log file: O_APPEND file with batched writes, reopened on SIGUSR1.
+ * Set by daemond_daemonize() when d->log_file is given
+ */
+int    daemond_log_file_open(const char * path, size_t buffer, double flush_interval, double fsync_interval);
+int    daemond_log_file_reopen(void);
+void   daemond_log_file_flush(void);
+void   daemond_log_file_close(void);
+void   daemond_log_file_tracer(const char * fmt, va_list va_args);
+
+/*
+ * Syslog sink: one datagram per line over a unix socket, journald native
+ * protocol or RFC 5424, with name, slot, pid and severity attached.
+ * path NULL means the default socket of the format
+ */
+typedef enum { DAEMOND_SYSLOG_JOURNAL, DAEMOND_SYSLOG_RFC5424 } daemond_syslog_format;
+
+int    daemond_syslog_open(daemond * d, const char * path, daemond_syslog_format format, int facility);
+void   daemond_syslog_tracer(const char * fmt, va_list va_args);
+void   daemond_syslog_tracer_debug(const char * fmt, va_list va_args);
+void   daemond_syslog_flush(void);
+void   daemond_syslog_close(void);
+unsigned long daemond_syslog_dropped(void);
+
+/*
+ * Flight recorder: with d->flight_records set, workers keep their last
+ * traced records in shared memory, master prints them when a worker dies
+ * abnormally. daemond_flight() records without tracing
+ */
+void   daemond_flight(const char * fmt, ...);
 
 /*
  * Pid functions
@@ -76,6 +335,30 @@ void  daemond_pid_relock(daemond_pid * pid);
 void  daemond_pid_forget(daemond_pid * pid);
 void  daemond_pid_close(daemond_pid * pid);
 
+/*
+ * Status file: copies a consistent snapshot of up to size bytes, returns
+ * number of slots or -1. daemond_status_alive() tells whether the master
+ * described is still the same process
+ */
+
+int   daemond_status_load(const char * path, daemond_status * st, size_t size);
+int   daemond_status_alive(const daemond_status * st);
+
+/*
+ * Instance socket: "\0daemond/<name>" bound by the single running instance.
+ * Its master answers one line commands: pid, stop, status, scale <n>,
+ * reload (replace workers), drain (let workers finish, then exit) and any
+ * registered one. A handler prints its answer into reply and returns 0,
+ * or -1 to answer with an error
+ */
+
+typedef int (*daemond_command)(struct _daemond * d, const char * args, char * reply, size_t size);
+
+int   daemond_lock_socket(struct _daemond * d);
+pid_t daemond_lock_pid(struct _daemond * d);
+int   daemond_control_register(const char * name, daemond_command handler);
+int   daemond_control_call(struct _daemond * d, const char * command, char * reply, size_t size);
+
 /*
  * CLI functions
  */
@@ -84,6 +367,24 @@ pid_t daemond_cli_kill(daemond_cli * cli, pid_t pid);
 void  daemond_cli_usage(daemond_cli * cli); // TODO
 void  daemond_cli_run(daemond_cli * cli, int argc, char *argv[]);
 
+/*
+ * Fleet: runs "check", "start", "stop" or "restart" over many instances at
+ * once, targets are pidfiles or "@name" for instance sockets. Start runs
+ * the shell command of the item. Stop stages take d->stop_* timeouts.
+ * Returns number of failed items, every item gets its result
+ */
+
+typedef struct {
+	const char      * target;
+	const char      * start;       // shell command starting the instance
+	int               result;      // 0 - ok, -1 - failed
+	pid_t             pid;
+	double            took;        // seconds
+	char              message[96];
+} daemond_fleet_item;
+
+int   daemond_fleet(struct _daemond * d, const char * command, daemond_fleet_item * items, int count, int concurrency);
+
 /*
  * SIG functions
  */
@@ -92,8 +393,8 @@ void  daemond_cli_run(daemond_cli * cli, int argc, char *argv[]);
 #define NSIG 128
 #endif
 
-volatile sig_atomic_t daemond_sig_was_received;
-volatile sig_atomic_t daemond_sig_received[NSIG];
+extern volatile sig_atomic_t daemond_sig_was_received;
+extern volatile sig_atomic_t daemond_sig_received[NSIG];
 
 void daemond_sig_init(daemond * d);
 
@@ -110,6 +411,64 @@ void daemond_daemonize(daemond * d);
 void daemond_log_std_intercept(daemond * d);
 void daemond_log_std_read(daemond * d);
 
+/*
+ * Thread workers
+ *
+ * With threads_per_child set every forked worker runs a pool of them: the
+ * slot argument is the thread's index in the pool, d->slot the process's
+ */
+
+int   daemond_stopping(daemond * d); // asked to stop, in a thread worker
+int   daemond_stop_fd(daemond * d);  // readable once asked to stop, -1 outside a thread worker
+
+/*
+ * Metrics: master counts forks, deaths, restart latency, signals and bytes
+ * of captured output; with d->metrics_listen they are served over HTTP in
+ * Prometheus text format, "metrics" on the instance socket answers the same.
+ * Thread workers are counted as running only
+ */
+
+int   daemond_metrics_format(daemond * d, char * buf, size_t size); // length, -1 if buf is short
+
+/*
+ * Lifecycle hooks: called by master, in registration order, for forks of
+ * process workers, their reaping, respawn delays, signals taken by the loop
+ * and shutdown. DAEMOND_HOOK_CHILD runs in the forked worker before
+ * daemond_master() returns there. Register before daemond_master(); an
+ * event without hooks costs a load and a branch
+ */
+
+typedef enum {
+	DAEMOND_HOOK_PRE_FORK,  // master, slot is about to be forked
+	DAEMOND_HOOK_CHILD,     // forked worker, pid is its own
+	DAEMOND_HOOK_FORKED,    // master, pid of the new worker
+	DAEMOND_HOOK_REAPED,    // master, status decoded
+	DAEMOND_HOOK_RESPAWN,   // master, forks wait for after seconds
+	DAEMOND_HOOK_SIGNAL,    // master, signo is dispatched
+	DAEMOND_HOOK_SHUTDOWN,  // master, workers are stopped, exit follows
+	DAEMOND_HOOKS
+} daemond_hook_event;
+
+#define DAEMOND_HOOKS_MAX 8 // per event
+
+typedef struct {
+	daemond_hook_event event;
+	int               slot;     // -1 if not about a worker
+	pid_t             pid;
+	int               status;   // REAPED: wait status,
+	int               exitcode; //   decoded
+	int               termsig;
+	int               core;
+	int               died;     //   counts as death, delays respawn
+	int               signo;    // SIGNAL
+	double            after;    // RESPAWN
+} daemond_event;
+
+typedef void (*daemond_hook)(struct _daemond * d, const daemond_event * ev, void * arg);
+
+int   daemond_hook_add(daemond_hook_event event, daemond_hook hook, void * arg); // -1 and ENOSPC if full
+int   daemond_hook_del(daemond_hook_event event, daemond_hook hook, void * arg);
+
 /*
  * Main init functions
  */